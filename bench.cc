@@ -0,0 +1,682 @@
+#include <unistd.h>
+#include <sysexits.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "libpstack/elf.h"
+#include "libpstack/dwarf.h"
+#include "libpstack/proc.h"
+
+/*
+ * Microbenchmarks for the hot paths in libpstack. Each mode loads its
+ * subject, builds a workload, and reports the rate it achieved.
+ */
+
+using namespace std;
+
+namespace {
+
+struct Timer {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double elapsed() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+};
+
+void
+report(const char *what, size_t count, double secs, const char *unit)
+{
+    cout << what << ": " << count << " " << unit << " in " << secs << "s, "
+        << size_t(count / secs) << " " << unit << "/sec\n";
+}
+
+/*
+ * Linear scan of the decoded FDEs, as CFI::findFDE used to do, for comparison.
+ */
+const Dwarf::FDE *
+linearFindFDE(const Dwarf::CFI &cfi, Elf::Addr addr)
+{
+    for (const auto &fde : cfi.fdes)
+        if (fde.second.iloc <= addr && fde.second.iloc + fde.second.irange > addr)
+            return &fde.second;
+    return nullptr;
+}
+
+void
+benchFDE(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 1000000;
+    Timer load;
+    auto dwarf = cache.getDwarf(name);
+    cout << "load " << name << ": " << load.elapsed() << "s\n";
+
+    for (auto cfi : { dwarf->ehFrame.get(), dwarf->debugFrame.get() }) {
+        if (cfi == nullptr)
+            continue;
+        const char *section = cfi->type == Dwarf::FI_EH_FRAME ? ".eh_frame" : ".debug_frame";
+
+        if (cfi->lazy) {
+            Timer decode;
+            cfi->decodeAll();
+            cout << section << ": indexed from .eh_frame_hdr, full decode takes "
+                << decode.elapsed() << "s\n";
+        }
+
+        // Look up a mix of addresses: the start and middle of each FDE.
+        vector<Elf::Addr> addrs;
+        for (const auto &fde : cfi->fdes) {
+            addrs.push_back(fde.second.iloc);
+            addrs.push_back(fde.second.iloc + fde.second.irange / 2);
+        }
+        if (addrs.empty())
+            continue;
+        shuffle(addrs.begin(), addrs.end(), mt19937(0));
+        cout << section << ": " << cfi->fdes.size() << " FDEs\n";
+
+        size_t found = 0;
+        Timer indexed;
+        for (size_t i = 0; i < iterations; ++i)
+            found += cfi->findFDE(addrs[i % addrs.size()]) != nullptr;
+        report("  findFDE", iterations, indexed.elapsed(), "lookups");
+
+        // The linear scan is far slower: keep its run short.
+        size_t linearIterations = min(iterations, size_t(10000));
+        Timer linear;
+        for (size_t i = 0; i < linearIterations; ++i)
+            found += linearFindFDE(*cfi, addrs[i % addrs.size()]) != nullptr;
+        report("  linear scan", linearIterations, linear.elapsed(), "lookups");
+        if (found == 0)
+            cout << "  (no lookups succeeded)\n";
+    }
+}
+
+void
+collectDIEs(const Dwarf::DIE &die, vector<Dwarf::DIE> &dies)
+{
+    dies.push_back(die);
+    for (auto child : die.children())
+        collectDIEs(child, dies);
+}
+
+/*
+ * DIE::attribute and DIE::name over every DIE in .debug_info. The attributes
+ * looked up are a mix of ones most DIEs have, and ones most don't.
+ */
+void
+benchAttributes(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 10000000;
+    auto dwarf = cache.getDwarf(name);
+    vector<Dwarf::DIE> dies;
+    Timer walk;
+    for (const auto &unit : dwarf->getUnits())
+        collectDIEs(unit->root(), dies);
+    cout << name << ": " << dies.size() << " DIEs, walked in " << walk.elapsed() << "s\n";
+    if (dies.empty())
+        return;
+
+    static const Dwarf::AttrName names[] = {
+        Dwarf::DW_AT_type, Dwarf::DW_AT_low_pc, Dwarf::DW_AT_decl_line, Dwarf::DW_AT_external
+    };
+    size_t found = 0;
+    Timer attrs;
+    for (size_t i = 0; i < iterations; ++i)
+        found += dies[i % dies.size()].attribute(names[i % 4], true).valid();
+    report("  attribute", iterations, attrs.elapsed(), "lookups");
+
+    size_t chars = 0;
+    Timer named;
+    for (size_t i = 0; i < iterations; ++i)
+        chars += dies[i % dies.size()].name().size();
+    report("  name", iterations, named.elapsed(), "lookups");
+    if (found == 0 || chars == 0)
+        cout << "  (no lookups succeeded)\n";
+}
+
+/*
+ * Linear scan of a line table, as sourceFromAddr used to do, for comparison.
+ */
+size_t
+linearFindRow(const Dwarf::LineInfo &lines, Elf::Addr addr)
+{
+    const auto &matrix = lines.matrix;
+    for (size_t i = 0; i + 1 < matrix.size(); ++i) {
+        if (matrix.flags[i] & Dwarf::LINE_END_SEQUENCE)
+            continue;
+        if (matrix.addr[i] <= addr && matrix.addr[i + 1] > addr)
+            return i;
+    }
+    return Dwarf::LineInfo::NOROW;
+}
+
+void
+benchLines(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 1000000;
+    auto dwarf = cache.getDwarf(name);
+    vector<pair<const Dwarf::LineInfo *, Elf::Addr>> queries;
+    size_t rows = 0, units = 0;
+    Timer load;
+    for (const auto &unit : dwarf->getUnits()) {
+        auto lines = unit->getLines();
+        if (lines == nullptr)
+            continue;
+        units++;
+        rows += lines->matrix.size();
+        for (size_t i = 0; i + 1 < lines->matrix.size(); ++i) {
+            queries.emplace_back(lines, lines->matrix.addr[i]);
+            queries.emplace_back(lines, (lines->matrix.addr[i] + lines->matrix.addr[i + 1]) / 2);
+        }
+    }
+    cout << name << ": " << units << " line tables, " << rows << " rows, loaded in "
+        << load.elapsed() << "s\n";
+    if (queries.empty())
+        return;
+    shuffle(queries.begin(), queries.end(), mt19937(0));
+
+    size_t found = 0;
+    Timer indexed;
+    for (size_t i = 0; i < iterations; ++i) {
+        const auto &q = queries[i % queries.size()];
+        found += q.first->findRow(q.second) != Dwarf::LineInfo::NOROW;
+    }
+    report("  findRow", iterations, indexed.elapsed(), "lookups");
+
+    size_t linearIterations = min(iterations, size_t(10000));
+    size_t mismatches = 0;
+    Timer linear;
+    for (size_t i = 0; i < linearIterations; ++i) {
+        const auto &q = queries[i % queries.size()];
+        mismatches += linearFindRow(*q.first, q.second) != q.first->findRow(q.second);
+    }
+    report("  linear scan", linearIterations, linear.elapsed(), "lookups");
+    if (mismatches != 0)
+        cout << "  " << mismatches << " lookups differ from the linear scan\n";
+    if (found == 0)
+        cout << "  (no lookups succeeded)\n";
+}
+
+/*
+ * The unit for an address found by asking each unit's root DIE, as
+ * lookupUnit did for objects without .debug_aranges.
+ */
+off_t
+scanUnits(const Dwarf::Info &dwarf, Elf::Addr addr)
+{
+    for (const auto &unit : dwarf.getUnits())
+        if (unit->root().containsAddress(addr) == Dwarf::ContainsAddr::YES)
+            return unit->offset;
+    return -1;
+}
+
+/*
+ * Address to unit lookups, for addresses taken from the units' line tables.
+ */
+void
+benchUnits(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 1000000;
+    auto dwarf = cache.getDwarf(name);
+    vector<Elf::Addr> queries;
+    for (const auto &unit : dwarf->getUnits()) {
+        auto lines = unit->getLines();
+        if (lines == nullptr)
+            continue;
+        for (size_t i = 0; i < lines->matrix.size(); ++i)
+            if ((lines->matrix.flags[i] & Dwarf::LINE_END_SEQUENCE) == 0)
+                queries.push_back(lines->matrix.addr[i]);
+    }
+    if (queries.empty())
+        return;
+    shuffle(queries.begin(), queries.end(), mt19937(0));
+
+    Timer first;
+    dwarf->lookupUnit(queries[0]);
+    cout << name << ": " << queries.size() << " addresses, first lookup took "
+        << first.elapsed() << "s\n";
+
+    size_t found = 0;
+    Timer indexed;
+    for (size_t i = 0; i < iterations; ++i)
+        found += dwarf->lookupUnit(queries[i % queries.size()]) != nullptr;
+    report("  lookupUnit", iterations, indexed.elapsed(), "lookups");
+
+    size_t scanIterations = min(iterations, size_t(10000));
+    size_t mismatches = 0;
+    Timer scan;
+    for (size_t i = 0; i < scanIterations; ++i) {
+        auto addr = queries[i % queries.size()];
+        auto unit = dwarf->lookupUnit(addr);
+        mismatches += scanUnits(*dwarf, addr) != (unit ? unit->offset : -1);
+    }
+    report("  root DIE scan", scanIterations, scan.elapsed(), "lookups");
+    if (mismatches != 0)
+        cout << "  " << mismatches << " lookups differ from the root DIEs' ranges\n";
+    if (found == 0)
+        cout << "  (no lookups succeeded)\n";
+}
+
+/*
+ * Qualified names of the definitions at namespace and class scope under
+ * "scope", as findDefinitions would take them.
+ */
+void
+collectNames(const Dwarf::DIE &scope, const string &prefix, vector<string> &names)
+{
+    for (const auto &child : scope.children()) {
+        auto name = child.name();
+        switch (child.tag()) {
+            case Dwarf::DW_TAG_namespace:
+            case Dwarf::DW_TAG_class_type:
+            case Dwarf::DW_TAG_structure_type:
+            case Dwarf::DW_TAG_union_type:
+                if (name != "" && !bool(child.attribute(Dwarf::DW_AT_declaration, true)))
+                    names.push_back(prefix + name);
+                collectNames(child, name == "" ? prefix : prefix + name + "::", names);
+                break;
+            case Dwarf::DW_TAG_subprogram:
+            case Dwarf::DW_TAG_variable:
+                if (name != "" && !bool(child.attribute(Dwarf::DW_AT_declaration, true))
+                      && !child.attribute(Dwarf::DW_AT_specification, true).valid())
+                    names.push_back(prefix + name);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * Name to DIE lookups through Info::findDefinitions, for the names defined in
+ * the object's units.
+ */
+void
+benchNames(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 100000;
+    vector<string> queries;
+    {
+        // Collect the names with a separate Info, so the one we time starts cold.
+        auto walked = make_shared<Dwarf::Info>(cache.getImageForName(name), cache);
+        for (const auto &unit : walked->getUnits())
+            collectNames(unit->root(), "", queries);
+    }
+    if (queries.empty())
+        return;
+    sort(queries.begin(), queries.end());
+    queries.erase(unique(queries.begin(), queries.end()), queries.end());
+    shuffle(queries.begin(), queries.end(), mt19937(0));
+
+    auto dwarf = cache.getDwarf(name);
+    Timer first;
+    dwarf->findDefinitions(queries[0]);
+    cout << name << ": " << queries.size() << " names, first lookup took "
+        << first.elapsed() << "s\n";
+
+    size_t found = 0;
+    Timer lookups;
+    for (size_t i = 0; i < iterations; ++i)
+        found += !dwarf->findDefinitions(queries[i % queries.size()]).empty();
+    report("  findDefinitions", iterations, lookups.elapsed(), "lookups");
+    cout << "  " << found * 100 / iterations << "% of lookups found a DIE\n";
+}
+
+/*
+ * Info::indexUnits on a fresh Info for the object, with increasing numbers of
+ * threads.
+ */
+void
+benchIndex(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    unsigned maxJobs = iterations != 0 ? iterations
+        : max(4U, thread::hardware_concurrency());
+    auto obj = cache.getImageForName(name);
+    for (unsigned jobs = 1; jobs <= maxJobs; jobs *= 2) {
+        auto dwarf = make_shared<Dwarf::Info>(obj, cache);
+        Timer index;
+        dwarf->indexUnits(jobs);
+        cout << name << ": indexed with " << jobs << " threads in " << index.elapsed() << "s\n";
+    }
+}
+
+/*
+ * The original CacheReader: 16 pages of 256 bytes, found by a linear scan of
+ * a list kept in LRU order. Kept here as the baseline for the page cache.
+ */
+class ListCacheReader : public Reader {
+    static const size_t PAGESIZE = 256;
+    static const size_t MAXPAGES = 16;
+    struct Page {
+        off_t offset;
+        size_t len;
+        char data[PAGESIZE];
+    };
+    Reader::csptr upstream;
+    mutable std::list<Page *> pages;
+    Page *getPage(off_t pageoff) const {
+        for (auto i = pages.begin(); i != pages.end(); ++i) {
+            Page *p = *i;
+            if (p->offset == pageoff) {
+                if (i != pages.begin()) {
+                    pages.erase(i);
+                    pages.push_front(p);
+                }
+                return p;
+            }
+        }
+        Page *p;
+        if (pages.size() == MAXPAGES) {
+            p = pages.back();
+            pages.pop_back();
+        } else {
+            p = new Page();
+        }
+        try {
+            p->len = upstream->read(pageoff, PAGESIZE, p->data);
+        }
+        catch (const std::exception &) {
+            p->len = 0;
+        }
+        p->offset = pageoff;
+        pages.push_front(p);
+        return p;
+    }
+public:
+    ListCacheReader(Reader::csptr upstream_) : upstream(move(upstream_)) {}
+    ~ListCacheReader() { for (auto p : pages) delete p; }
+    size_t read(off_t off, size_t count, char *ptr) const override {
+        off_t startoff = off;
+        while (count != 0) {
+            size_t offsetOfDataInPage = off % PAGESIZE;
+            Page *page = getPage(off - offsetOfDataInPage);
+            if (page->len <= offsetOfDataInPage)
+                break;
+            size_t chunk = min(page->len - offsetOfDataInPage, count);
+            memcpy(ptr, page->data + offsetOfDataInPage, chunk);
+            off += chunk;
+            count -= chunk;
+            ptr += chunk;
+            if (page->len != PAGESIZE)
+                break;
+        }
+        return off - startoff;
+    }
+    void describe(std::ostream &os) const override { os << *upstream; }
+    off_t size() const override { return upstream->size(); }
+    string filename() const override { return upstream->filename(); }
+};
+
+/*
+ * Counts the reads that get through to the file underneath a cache.
+ */
+class CountingReader : public FileReader {
+public:
+    mutable size_t reads = 0;
+    CountingReader(const string &name) : FileReader(name) {}
+    size_t read(off_t off, size_t count, char *ptr) const override {
+        ++reads;
+        return FileReader::read(off, count, ptr);
+    }
+};
+
+/*
+ * Unwind and print every thread in a core, with arguments, reading the core
+ * through "cache".
+ */
+void
+unwindCore(Dwarf::ImageCache &cache, Reader::csptr coreReader)
+{
+    PstackOptions options;
+    options.set(PstackOption::doargs);
+    auto core = make_shared<Elf::Object>(cache, coreReader);
+    Elf::Object::sptr exec;
+    CoreProcess proc(exec, core, PathReplacementList(), cache);
+    proc.load(options);
+    StopProcess here(&proc);
+    ofstream null("/dev/null");
+    Dwarf::FrameArena arena;
+    for (auto &lwp : proc.lwps) {
+        ThreadStack stack;
+        stack.info.ti_lid = lwp.first;
+        Elf::CoreRegisters regs;
+        proc.getRegs(lwp.first, &regs);
+        stack.unwind(proc, regs, arena);
+        proc.dumpStackText(null, stack, options);
+    }
+}
+
+void
+benchCache(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 20;
+    unwindCore(cache, make_shared<FileReader>(name)); // warm the image cache.
+
+    auto run = [&] (const char *what, auto makeCache) {
+        auto file = make_shared<CountingReader>(name);
+        Timer timer;
+        for (size_t i = 0; i < iterations; ++i)
+            unwindCore(cache, makeCache(file));
+        report(what, iterations, timer.elapsed(), "unwinds");
+        cout << "    " << file->reads / iterations << " upstream reads per unwind\n";
+    };
+    run("  list cache, 16 x 256 bytes", [] (Reader::csptr file) {
+        return make_shared<ListCacheReader>(file); });
+    run("  hashed cache, 16 x 256 bytes", [] (Reader::csptr file) {
+        return make_shared<CacheReader>(file, 256, 16); });
+    run("  hashed cache, default size", [] (Reader::csptr file) {
+        return make_shared<CacheReader>(file); });
+    run("  hashed cache, 1024 x 4KiB", [] (Reader::csptr file) {
+        return make_shared<CacheReader>(file, 4096, 1024); });
+}
+
+/*
+ * Unwind every thread in a core, without printing anything.
+ */
+void
+benchUnwind(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 100;
+    auto core = make_shared<Elf::Object>(cache, loadFile(name));
+    Elf::Object::sptr exec;
+    CoreProcess proc(exec, core, PathReplacementList(), cache);
+    proc.load(PstackOptions());
+    StopProcess here(&proc);
+    vector<Elf::CoreRegisters> threads;
+    for (auto &lwp : proc.lwps) {
+        threads.emplace_back();
+        proc.getRegs(lwp.first, &threads.back());
+    }
+
+    // The first pass loads the images and their unwind tables.
+    Dwarf::FrameArena arena;
+    auto unwindAll = [&] () {
+        size_t frames = 0;
+        for (auto &regs : threads) {
+            ThreadStack stack;
+            stack.unwind(proc, regs, arena);
+            frames += stack.stack.size();
+        }
+        arena.reset();
+        return frames;
+    };
+    Timer first;
+    size_t frames = unwindAll();
+    cout << name << ": " << threads.size() << " threads, " << frames << " frames, first unwind "
+        << first.elapsed() << "s\n";
+
+    Timer timer;
+    for (size_t i = 0; i < iterations; ++i)
+        unwindAll();
+    report("  unwind", frames * iterations, timer.elapsed(), "frames");
+}
+
+/*
+ * Counts the bytes written through an ostream, and discards them.
+ */
+class CountingBuf : public streambuf {
+public:
+    size_t bytes = 0;
+protected:
+    int_type overflow(int_type c) override { ++bytes; return traits_type::not_eof(c); }
+    streamsize xsputn(const char *, streamsize count) override { bytes += count; return count; }
+};
+
+/*
+ * Sends stdout to /dev/null for the lifetime of this object.
+ */
+class StdoutToNull {
+    int saved;
+public:
+    StdoutToNull() {
+        cout.flush();
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        if (saved == -1 || freopen("/dev/null", "w", stdout) == nullptr)
+            throw (Exception() << "can't redirect stdout");
+    }
+    ~StdoutToNull() {
+        cout.flush();
+        fflush(stdout);
+        dup2(saved, fileno(stdout));
+        close(saved);
+    }
+    StdoutToNull(const StdoutToNull &) = delete;
+    StdoutToNull &operator = (const StdoutToNull &) = delete;
+};
+
+/*
+ * Dump the DWARF of an object as JSON, as "pstack -D" does. The output goes
+ * to /dev/null through a file stream and through stdio's stdout, each with
+ * and without a JSONWriter.
+ */
+void
+benchJSON(Dwarf::ImageCache &cache, const char *name, size_t iterations)
+{
+    if (iterations == 0)
+        iterations = 3;
+    auto info = cache.getDwarf(name);
+    CountingBuf counter;
+    ostream counted(&counter);
+    Timer first;
+    counted << json(*info); // The first pass decodes all the DIEs.
+    cout << name << ": " << counter.bytes << " bytes of JSON, first dump " << first.elapsed() << "s\n";
+    StdoutToNull quiet; // until we return, so later modes still print.
+
+    auto run = [&] (const char *what, ostream &os, bool buffered) {
+        Timer timer;
+        for (size_t i = 0; i < iterations; ++i) {
+            unique_ptr<JSONWriter> writer;
+            if (buffered)
+                writer.reset(new JSONWriter(os));
+            os << json(*info);
+        }
+        os.flush();
+        double secs = timer.elapsed();
+        clog << what << ": " << secs / iterations << "s per dump, "
+            << size_t(counter.bytes * iterations / secs / 1e6) << " MB/sec\n";
+    };
+    ofstream null("/dev/null");
+    run("  ofstream", null, false);
+    run("  ofstream with JSONWriter", null, true);
+    run("  cout", cout, false);
+    run("  cout with JSONWriter", cout, true);
+}
+
+int
+usage(const char *name)
+{
+    clog << "usage: " << name << " [-n iterations] <mode>...\n"
+        "modes:\n"
+        "\t-f <elf object>      FDE lookups per second\n"
+        "\t-i <elf object>      time to index DWARF units with 1, 2, 4... threads (up to -n)\n"
+        "\t-c <core>            core unwinds per second for each page cache\n"
+        "\t-d <elf object>      DIE attribute and name lookups per second\n"
+        "\t-u <core>            frames unwound per second\n"
+        "\t-j <elf object>      JSON output rate for the object's DWARF\n"
+        "\t-l <elf object>      source line lookups per second\n"
+        "\t-s <elf object>      name to DIE lookups per second\n"
+        "\t-a <elf object>      address to unit lookups per second\n";
+    return EX_USAGE;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t iterations = 0; // use the default for each mode.
+    Dwarf::ImageCache cache;
+    int c;
+    bool ran = false;
+    try {
+        while ((c = getopt(argc, argv, "n:a:c:d:f:i:j:l:s:u:v")) != -1) {
+            switch (c) {
+                case 'n':
+                    iterations = strtoull(optarg, nullptr, 0);
+                    break;
+                case 'a':
+                    benchUnits(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'c':
+                    benchCache(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'd':
+                    benchAttributes(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'f':
+                    benchFDE(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'i':
+                    benchIndex(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'j':
+                    benchJSON(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'l':
+                    benchLines(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 's':
+                    benchNames(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'u':
+                    benchUnwind(cache, optarg, iterations);
+                    ran = true;
+                    break;
+                case 'v':
+                    verbose++;
+                    break;
+                default:
+                    return usage(argv[0]);
+            }
+        }
+    }
+    catch (const exception &ex) {
+        clog << "error: " << ex.what() << endl;
+        return EX_SOFTWARE;
+    }
+    return ran ? 0 : usage(argv[0]);
+}
@@ -3,6 +3,7 @@
 
 #include <sys/procfs.h>
 
+#include <algorithm>
 #include <cassert>
 #include <iomanip>
 #include <set>
@@ -229,12 +230,20 @@ std::ostream &operator << (std::ostream &os, const JSON<Dwarf::FileEntry> &jobj)
 }
 
 template <typename C>
-std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineState, C> &jo) {
-    auto &ls = jo.object;
-    return JObject(os)
-        .field("file", *ls.file)
-        .field("line", ls.line)
-        .field("addr", ls.addr);
+std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineInfo::Matrix, C> &jo) {
+    auto &matrix = jo.object;
+    auto lines = jo.context;
+    JSONOut::raw(os, "[ ");
+    for (size_t row = 0; row < matrix.size(); ++row) {
+        if (row != 0)
+            JSONOut::raw(os, ",\n");
+        JObject(os)
+            .field("file", lines->fileAt(row))
+            .field("line", matrix.line[row])
+            .field("addr", matrix.addr[row]);
+    }
+    JSONOut::raw(os, " ]");
+    return os;
 }
 
 template <typename C>
@@ -246,7 +255,7 @@ std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineInfo, C> &jo)
         .field("opcode_lengths", lines.opcode_lengths)
         .field("files", lines.files)
         .field("directories", lines.directories)
-        .field("matrix", lines.matrix);
+        .field("matrix", lines.matrix, &lines);
 }
 
 template <typename C>
@@ -481,11 +490,14 @@ operator << (std::ostream &os, const JSON<AddrStr> &addr)
 std::ostream &
 operator << (std::ostream &os, const JSON<Dwarf::CFI> &info)
 {
+    info.object.decodeAll();
     Mapper<AddrStr, decltype(info.object.cies)::mapped_type, decltype(info.object.cies)>
        ciesByString(info.object.cies);
+    Mapper<AddrStr, decltype(info.object.fdes)::mapped_type, decltype(info.object.fdes)>
+       fdesByString(info.object.fdes);
     return JObject(os)
         .field("cielist", ciesByString, &info.object)
-        .field("fdelist", info.object.fdeList, &info.object);
+        .field("fdelist", fdesByString, &info.object);
 }
 
 std::ostream &
@@ -535,11 +547,9 @@ std::ostream &operator << (std::ostream &os, const JSON<Elf::NoteDesc> &note)
                 break;
             }
             case NT_GNU_BUILD_ID: {
-                std::ostringstream os;
-                ReaderArray<uint8_t> content(*data);
-                for (auto c : content)
-                    os << std::hex << std::setw(2) << std::setfill('0') << int(c);
-                writer.field("buildid", os.str());
+                std::vector<unsigned char> content(data->size());
+                data->readObj(0, content.data(), content.size());
+                writer.field("buildid", JsonHex(content));
                 break;
             }
         }
@@ -9,17 +9,22 @@
 #include <libgen.h>
 #include <unistd.h>
 
+#include <cctype>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <new>
 #include <set>
 #include <sstream>
 #include <stack>
+#include <thread>
 #include <algorithm>
+#include <atomic>
 
 using std::make_unique;
 using std::make_shared;
@@ -27,24 +32,25 @@ using std::string;
 
 namespace {
 
+// Atomic, as Info::indexUnits decodes DIEs on several threads at once.
 struct Stats {
-    int totalDIEs;
-    int maxDIEs;
-    int currentDIEs;
+    std::atomic<int> totalDIEs;
+    std::atomic<int> maxDIEs;
+    std::atomic<int> currentDIEs;
     Stats() : totalDIEs{}, maxDIEs{}, currentDIEs{} {}
     ~Stats() {
         if (verbose > 2)
-            *debug << "DIEs: current=" << currentDIEs << ", total=" << totalDIEs
-                << ", max=" << maxDIEs << std::endl;
+            *debug << "DIEs: current=" << currentDIEs.load() << ", total=" << totalDIEs.load()
+                << ", max=" << maxDIEs.load() << std::endl;
     }
     void addone() {
         totalDIEs++;
-        currentDIEs++;
-        if (currentDIEs > maxDIEs)
-            maxDIEs = currentDIEs;
+        int current = ++currentDIEs;
+        if (current > maxDIEs)
+            maxDIEs = current;
     }
-    void delone() {
-        currentDIEs--;
+    void del(int count) {
+        currentDIEs -= count;
     }
 };
 
@@ -52,18 +58,21 @@ Stats stats;
 }
 
 namespace Dwarf {
+/*
+ * RawDIEs live in their unit's DIEArena, and are never destroyed
+ * individually: the arena's memory is released as a whole.
+ */
 class RawDIE {
     RawDIE() = delete;
     RawDIE(const RawDIE &) = delete;
     static void readValue(DWARFReader &, const FormEntry &form, Value &value, Unit *);
     const Abbreviation *type;
-    std::vector<Value> values;
+    Value *values; // one for each of type->forms, also in the arena.
     off_t parent; // 0 implies we do not yet know the parent's offset.
     off_t firstChild;
     off_t nextSibling;
 public:
     RawDIE(Unit *, DWARFReader &, size_t, off_t parent);
-    ~RawDIE();
     friend class Attribute;
     friend class DIE;
     friend class DIEAttributes;
@@ -71,6 +80,100 @@ public:
     friend class DIEIter;
 };
 
+/*
+ * Storage for the DIEs of one unit. RawDIEs, their values, and blocks are
+ * carved from a few large chunks, and found again by offset in a flat,
+ * open-addressed table, so decoding a whole unit makes few allocations, and
+ * dropping the arena frees it all at once.
+ */
+class DIEArena {
+    static const size_t MINCHUNK = 4096;
+    static const size_t MAXCHUNK = 1024 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char *next = nullptr;
+    size_t avail = 0;
+    size_t chunkSize = MINCHUNK; // doubles with each chunk, up to MAXCHUNK.
+    size_t chunkBytes = 0;
+
+    struct Slot {
+        off_t offset; // 0 for an empty slot: no DIE is at the start of a unit.
+        RawDIE *die;
+    };
+    std::vector<Slot> table; // size is a power of two, at most half full.
+    size_t count = 0;
+    size_t slot(off_t offset) const {
+        return (uintmax_t(offset) * 0x9e3779b97f4a7c15ULL) & (table.size() - 1);
+    }
+    void place(const Slot &);
+public:
+    DIEArena() = default;
+    DIEArena(const DIEArena &) = delete;
+    ~DIEArena() { stats.del(count); }
+    void *allocate(size_t size);
+    template <typename T> T *allocate(size_t n) {
+        return static_cast<T *>(allocate(n * sizeof (T)));
+    }
+    RawDIE *find(off_t offset) const;
+    void insert(off_t offset, RawDIE *);
+    size_t size() const { return count; }
+    size_t footprint() const { return chunkBytes + table.capacity() * sizeof (Slot); }
+};
+
+void *
+DIEArena::allocate(size_t size)
+{
+    size = (size + alignof(uintmax_t) - 1) & ~(alignof(uintmax_t) - 1);
+    if (size > avail) {
+        auto len = std::max(size, chunkSize);
+        chunks.emplace_back(new char[len]);
+        chunkBytes += len;
+        next = chunks.back().get();
+        avail = len;
+        if (chunkSize < MAXCHUNK)
+            chunkSize *= 2;
+    }
+    auto p = next;
+    next += size;
+    avail -= size;
+    return p;
+}
+
+RawDIE *
+DIEArena::find(off_t offset) const
+{
+    if (table.empty())
+        return nullptr;
+    for (size_t i = slot(offset);; i = (i + 1) & (table.size() - 1)) {
+        if (table[i].offset == offset)
+            return table[i].die;
+        if (table[i].offset == 0)
+            return nullptr;
+    }
+}
+
+void
+DIEArena::place(const Slot &ent)
+{
+    size_t i = slot(ent.offset);
+    while (table[i].offset != 0)
+        i = (i + 1) & (table.size() - 1);
+    table[i] = ent;
+}
+
+void
+DIEArena::insert(off_t offset, RawDIE *die)
+{
+    if ((count + 1) * 2 > table.size()) {
+        std::vector<Slot> old(std::max(table.size() * 2, size_t(64)), Slot{ 0, nullptr });
+        std::swap(old, table);
+        for (const auto &ent : old)
+            if (ent.offset != 0)
+                place(ent);
+    }
+    place(Slot{ offset, die });
+    count++;
+}
+
 DIEIter &DIEIter::operator++() {
     currentDIE = currentDIE.nextSibling(parent);
     // if we loaded the child by a direct refrence into the middle of the
@@ -96,8 +199,13 @@ DWARFReader::getuleb128shift(int &shift, bool &msb)
 {
     uintmax_t result;
     unsigned char byte;
+    if (!viewed)
+        loadView();
     for (result = 0, shift = 0;;) {
-        io->readObj(off++, &byte);
+        if (off < dataLen)
+            byte = data[off++];
+        else
+            io->readObj(off++, &byte);
         result |= uintmax_t(byte & 0x7f) << shift;
         shift += 7;
         if ((byte & 0x80) == 0)
@@ -179,18 +287,39 @@ Info::Info(Elf::Object::sptr obj, ImageCache &cache_)
     , altImageLoaded(false)
     , imageCache(cache_)
     , pubnamesh(sectionReader(*obj, ".debug_pubnames", ".zdebug_pubnames"))
+    , debugNamesh(sectionReader(*obj, ".debug_names", ".zdebug_names"))
+    , gdbIndexh(sectionReader(*obj, ".gdb_index", nullptr))
     , arangesh(sectionReader(*obj, ".debug_aranges", ".zdebug_aranges"))
     , rangesh(sectionReader(*obj, ".debug_ranges", ".zdebug_ranges"))
     , haveLines(bool(lineshdr))
     , haveARanges(bool(arangesh))
 {
+    units.budget = cache_.unitCacheBudget;
     auto f = [this, &obj](const char *name, const char *zname, FIType ftype) {
         const Elf::Section *sec;
         auto io = sectionReader(*obj, name, zname, &sec);
         if (!io)
             return std::unique_ptr<CFI>();
+
+        // .eh_frame_hdr lets us find FDEs in .eh_frame without decoding them all.
+        Reader::csptr hdr;
+        Elf::Addr hdrAddr = 0;
+        if (ftype == FI_EH_FRAME) {
+            const Elf::Section *hdrsec;
+            hdr = sectionReader(*obj, ".eh_frame_hdr", nullptr, &hdrsec);
+            if (hdr) {
+                hdrAddr = hdrsec->shdr.sh_addr;
+            } else {
+                for (const auto &phdr : obj->getSegments(PT_GNU_EH_FRAME)) {
+                    hdr = std::make_shared<OffsetReader>(obj->io, phdr.p_offset, phdr.p_filesz);
+                    hdrAddr = phdr.p_vaddr;
+                    break;
+                }
+            }
+        }
         try {
-            return make_unique<CFI>(this, sec->shdr.sh_addr, io, ftype);
+            return make_unique<CFI>(this, sec->shdr.sh_addr, io, ftype, hdr, hdrAddr,
+                  imageCache.indexPath(*obj, name + 1));
         }
         catch (const Exception &ex) {
             *debug << "can't decode " << name << " for " << *obj->io << ": "
@@ -214,53 +343,337 @@ Info::pubnames() const
     return pubnameUnits;
 }
 
-static size_t UNITCACHE_SIZE=256;
+/*
+ * Load whichever name indexes we have. If one is broken, we complain, and
+ * fall back to the next.
+ */
+void
+Info::loadNameIndexes() const
+{
+    if (nameIndexesLoaded)
+        return;
+    nameIndexesLoaded = true;
+    if (debugNamesh) {
+        try {
+            debugNames = make_unique<DebugNames>(debugNamesh, debugStrings);
+        }
+        catch (const Exception &ex) {
+            *debug << "can't decode .debug_names for " << *elf->io << ": "
+                << ex.what() << "\n";
+        }
+    }
+    if (!debugNames && gdbIndexh) {
+        try {
+            gdbIndex = make_unique<GdbIndex>(gdbIndexh);
+        }
+        catch (const Exception &ex) {
+            *debug << "can't decode .gdb_index for " << *elf->io << ": "
+                << ex.what() << "\n";
+        }
+    }
+    if (debugNames || gdbIndex)
+        return;
+    for (const auto &unit : pubnames())
+        for (const auto &name : unit.pubnames)
+            pubnameIndex.emplace(name.name, unit.infoOffset + name.offset);
+    // .debug_pubtypes has the same layout, for types.
+    auto pubtypes = sectionReader(*elf, ".debug_pubtypes", ".zdebug_pubtypes");
+    if (pubtypes) {
+        DWARFReader r(pubtypes);
+        while (!r.empty()) {
+            PubnameUnit unit(r);
+            for (const auto &name : unit.pubnames)
+                pubnameIndex.emplace(name.name, unit.infoOffset + name.offset);
+        }
+    }
+}
+
+// Split a C++ qualified name into its components, leaving any "::" inside
+// template arguments or parameter lists alone. gdb's "(anonymous namespace)"
+// components are dropped, as anonymous namespaces are transparent to lookups.
+static std::vector<std::string>
+splitQualifiedName(const std::string &name)
+{
+    std::vector<std::string> path;
+    int nesting = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < name.size(); ++i) {
+        switch (name[i]) {
+            case '<': case '(':
+                ++nesting;
+                break;
+            case '>': case ')':
+                --nesting;
+                break;
+            case ':':
+                if (nesting == 0 && i + 1 < name.size() && name[i + 1] == ':') {
+                    auto component = name.substr(start, i - start);
+                    if (component != "(anonymous namespace)")
+                        path.push_back(component);
+                    start = ++i + 1;
+                }
+                break;
+        }
+    }
+    path.push_back(name.substr(start));
+    return path;
+}
+
+static bool
+isNamedScope(Tag tag)
+{
+    switch (tag) {
+        case DW_TAG_namespace:
+        case DW_TAG_class_type:
+        case DW_TAG_structure_type:
+        case DW_TAG_union_type:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+isDeclaration(const DIE &die)
+{
+    return bool(die.attribute(DW_AT_declaration, true));
+}
+
+/*
+ * The qualified name of a DIE: its own name, within the names of the scopes
+ * around it (or around its declaration, if it's defined out of line).
+ * Anonymous namespaces are transparent. Empty if the DIE is local to a
+ * function or block, or in an anonymous type.
+ */
+static std::string
+qualifiedName(const DIE &die)
+{
+    auto name = die.name();
+    if (name == "")
+        return name;
+    DIE scope = die;
+    auto spec = die.attribute(DW_AT_specification, true);
+    if (spec.valid())
+        scope = DIE(spec);
+    auto unit = scope.getUnit();
+    while (scope && !unit->isRoot(scope)) {
+        scope = unit->offsetToDIE(scope.getParentOffset());
+        if (!scope || unit->isRoot(scope))
+            break;
+        if (!isNamedScope(scope.tag()))
+            return "";
+        auto scopeName = scope.name();
+        if (scopeName != "")
+            name = scopeName + "::" + name;
+        else if (scope.tag() != DW_TAG_namespace)
+            return "";
+    }
+    return name;
+}
+
+/*
+ * As qualifiedName, but with the DIEs of the enclosing scopes, innermost
+ * first, taken from a name index rather than found in the DIE tree.
+ */
+static std::string
+scopedName(const Info &info, const DIE &die, const std::vector<off_t> &scopes)
+{
+    auto name = die.name();
+    if (name == "")
+        return name;
+    for (auto offset : scopes) {
+        auto scope = info.offsetToDIE(offset);
+        if (!scope || !isNamedScope(scope.tag()))
+            return "";
+        auto scopeName = scope.name();
+        if (scopeName != "")
+            name = scopeName + "::" + name;
+        else if (scope.tag() != DW_TAG_namespace)
+            return "";
+    }
+    return name;
+}
+
+/*
+ * Add the definitions in "scope", and in the named scopes within it, to
+ * "names", under their qualified names.
+ */
+static void
+collectDefinitions(const DIE &scope, const std::string &prefix,
+      std::unordered_multimap<std::string, off_t> &names)
+{
+    for (const auto &child : scope.children()) {
+        if (child.attribute(DW_AT_specification, true).valid()) {
+            // Defined out of line: it's named for where it was declared.
+            if (!isDeclaration(child)) {
+                auto name = qualifiedName(child);
+                if (name != "")
+                    names.emplace(name, child.getOffset());
+            }
+            continue;
+        }
+        auto name = child.name();
+        if (isNamedScope(child.tag())) {
+            if (name == "") {
+                if (child.tag() == DW_TAG_namespace)
+                    collectDefinitions(child, prefix, names);
+                continue;
+            }
+            if (!isDeclaration(child))
+                names.emplace(prefix + name, child.getOffset());
+            collectDefinitions(child, prefix + name + "::", names);
+        } else if (name != "" && !isDeclaration(child)) {
+            names.emplace(prefix + name, child.getOffset());
+        }
+    }
+}
+
+/*
+ * The definitions in a unit, by qualified name, collected on the first
+ * lookup that has to search it.
+ */
+const std::unordered_multimap<std::string, off_t> &
+Info::definitionsInUnit(off_t offset) const
+{
+    auto it = unitDefinitions.find(offset);
+    if (it == unitDefinitions.end()) {
+        it = unitDefinitions.emplace(offset, std::unordered_multimap<std::string, off_t>()).first;
+        collectDefinitions(getUnit(offset)->root(), "", it->second);
+    }
+    return it->second;
+}
+
+std::vector<DIE>
+Info::findDefinitions(const std::string &name) const
+{
+    loadNameIndexes();
+    auto path = splitQualifiedName(name);
+    std::string qualified;
+    for (const auto &component : path)
+        qualified += (qualified.empty() ? "" : "::") + component;
+
+    std::vector<off_t> offsets;
+    auto addFromUnit = [&] (off_t unit) {
+        auto range = definitionsInUnit(unit).equal_range(qualified);
+        for (auto it = range.first; it != range.second; ++it)
+            offsets.push_back(it->second);
+    };
+    std::vector<DIE> found;
+    if (debugNames) {
+        // .debug_names has unqualified names, so we check the scopes of each
+        // DIE, from its entry's parents if it has them. Otherwise, finding
+        // them means walking the DIE's unit, so we only do that when the
+        // name is qualified: an unqualified name matches in any scope.
+        std::vector<DebugNames::Match> matches;
+        debugNames->find(path.back(), matches);
+        for (const auto &match : matches) {
+            auto die = offsetToDIE(match.die);
+            if (!die || isDeclaration(die))
+                continue;
+            // An out-of-line definition is named for where it was declared.
+            if (match.scoped && !die.attribute(DW_AT_specification, true).valid()
+                  ? scopedName(*this, die, match.scopes) == qualified
+                  : path.size() == 1 || qualifiedName(die) == qualified)
+                found.push_back(die);
+        }
+        return found;
+    }
+    if (gdbIndex) {
+        // .gdb_index only tells us which units to search.
+        std::vector<off_t> units;
+        gdbIndex->find(name, units);
+        for (auto unit : units)
+            addFromUnit(unit);
+    } else if (!pubnameIndex.empty()) {
+        auto range = pubnameIndex.equal_range(name);
+        for (auto it = range.first; it != range.second; ++it)
+            offsets.push_back(it->second);
+    } else {
+        if (verbose > 1 && unitDefinitions.empty())
+            *debug << "no name index in " << *elf->io << ", searching all units\n";
+        for (const auto &unit : getUnits())
+            addFromUnit(unit->offset);
+    }
+    // A type can be listed more than once in .debug_pubtypes, for example.
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    for (auto offset : offsets) {
+        auto die = offsetToDIE(offset);
+        if (die)
+            found.push_back(die);
+    }
+    return found;
+}
+
+void
+UnitsCache::unlink(Entry &ent)
+{
+    (ent.newer ? ent.newer->older : newest) = ent.older;
+    (ent.older ? ent.older->newer : oldest) = ent.newer;
+    ent.newer = ent.older = nullptr;
+}
+
+void
+UnitsCache::measure(Entry &ent)
+{
+    auto now = ent.unit->footprint();
+    bytes += now - ent.bytes;
+    ent.bytes = now;
+}
 
 Unit::sptr
 UnitsCache::get(const Info *info, off_t offset)
 {
+    std::lock_guard<std::mutex> guard(lock);
+    if (newest != nullptr)
+        measure(*newest);
     auto &ent = byOffset[offset];
-    if (ent != nullptr) {
-        auto idx = std::find(LRU.begin(), LRU.end(), ent);
-        assert(idx != LRU.end());
-        LRU.erase(idx);
+    if (ent.unit != nullptr) {
+        hits++;
+        if (&ent == newest)
+            return ent.unit;
+        unlink(ent);
     } else {
+        misses++;
         DWARFReader r(info->io, offset);
-        ent = make_shared<Unit>(info, r);
+        ent.unit = make_shared<Unit>(info, r);
+        measure(ent);
         if (verbose >= 3)
-            *debug << "create unit " << ent->name() << "@" << offset
+            *debug << "create unit " << ent.unit->name() << "@" << offset
                       << " in " << *info->io << "\n";
     }
-    LRU.push_front(ent);
-    if (LRU.size() > UNITCACHE_SIZE) {
-        auto old = LRU.back();
-        // There might still be active DIEs in this unit, but we can purge its
-        // RawDIEs to potentially free them
-        old->purge();
-        LRU.pop_back();
-        // don't erase from the map - we hold on to the offsets so we can quickly
-        // determine which unit contains a particular DIE.
-        byOffset[old->offset] = 0;
+    ent.older = newest;
+    (newest ? newest->newer : oldest) = &ent;
+    newest = &ent;
+
+    // Evict from the old end until we're within budget, but always keep the
+    // unit we're returning.
+    while (bytes > budget && oldest != &ent) {
+        auto &old = *oldest;
         if (verbose > 3)
-            *debug << "evicted unit " << old->name() << "@" << old->offset
+            *debug << "evicted unit " << old.unit->name() << "@" << old.unit->offset
                       << " in " << *info->io << "\n";
+        unlink(old);
+        // There might still be active DIEs in this unit, but we can purge its
+        // RawDIEs to potentially free them
+        old.unit->purge();
+        old.unit = nullptr;
+        bytes -= old.bytes;
+        old.bytes = 0;
+        evictions++;
     }
-    return ent;
+    return ent.unit;
 }
 
 DIE
 Info::offsetToDIE(off_t offset) const
 {
     // find the appropriate unit for a die with that offset.
-    auto it = std::lower_bound(
-            units.byOffset.begin(),
-            units.byOffset.end(),
-            offset,
-            [] (const std::pair<off_t, std::shared_ptr<Unit>> &u, off_t offset)
-
-                { return u.first < offset; });
+    // Start at the last unit we know of that starts before it: units are
+    // contiguous, so we can walk forward from there.
+    auto it = units.byOffset.lower_bound(offset);
     off_t uOffset;
-    if (it == units.byOffset.begin() || it == units.byOffset.end()) {
+    if (it == units.byOffset.begin()) {
         uOffset = 0;
     } else {
         --it;
@@ -321,7 +734,7 @@ Info::decodeARangeSet(DWARFReader &r) const {
     while (r.getOffset() < next) {
         Elf::Addr start = r.getuint(addrlen);
         Elf::Addr length = r.getuint(addrlen);
-        aranges.ranges[start + length] = std::make_pair(length, debugInfoOffset);
+        aranges.add(start, start + length, debugInfoOffset);
     }
 }
 
@@ -329,49 +742,559 @@ bool Info::hasARanges() const {
     return haveARanges;
 }
 
-Unit::sptr
-Info::lookupUnit(Elf::Addr addr) const {
-    if (arangesh) {
-        DWARFReader r(arangesh);
-        while (!r.empty())
-            decodeARangeSet(r);
-        arangesh = nullptr;
+void
+ARanges::add(Elf::Addr start, Elf::Addr end, off_t unit)
+{
+    if (start < end)
+        ranges.push_back(Range{ start, end, unit });
+}
+
+void
+ARanges::index()
+{
+    std::sort(ranges.begin(), ranges.end(),
+          [] (const Range &l, const Range &r) {
+              return l.start < r.start || (l.start == r.start && l.end < r.end); });
+    maxEnd.resize(ranges.size());
+    Elf::Addr highest = 0;
+    for (size_t i = 0; i < ranges.size(); ++i)
+        maxEnd[i] = highest = std::max(highest, ranges[i].end);
+}
+
+off_t
+ARanges::find(Elf::Addr addr) const
+{
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), addr,
+          [] (Elf::Addr a, const Range &r) { return a < r.start; });
+    for (size_t i = it - ranges.begin(); i > 0 && maxEnd[i - 1] > addr; --i)
+        if (ranges[i - 1].end > addr)
+            return ranges[i - 1].unit;
+    return -1;
+}
+
+/*
+ * Read an attribute of a .debug_names entry. The forms are the constant and
+ * reference classes, which are all that make sense for DW_IDX_* attributes.
+ */
+static uintmax_t
+nameIndexValue(DWARFReader &r, Form form)
+{
+    switch (form) {
+        case DW_FORM_flag_present:
+            return 1;
+        case DW_FORM_flag:
+        case DW_FORM_data1:
+        case DW_FORM_ref1:
+            return r.getu8();
+        case DW_FORM_data2:
+        case DW_FORM_ref2:
+            return r.getu16();
+        case DW_FORM_data4:
+        case DW_FORM_ref4:
+            return r.getu32();
+        case DW_FORM_data8:
+        case DW_FORM_ref8:
+        case DW_FORM_ref_sig8:
+            return r.getuint(8);
+        case DW_FORM_udata:
+        case DW_FORM_ref_udata:
+            return r.getuleb128();
+        case DW_FORM_sdata:
+            return r.getsleb128();
+        default:
+            throw Exception() << "unexpected form " << form << " in .debug_names";
     }
-    auto it = aranges.ranges.upper_bound(addr);
-    if (it != aranges.ranges.end() && it->first - it->second.first <= addr)
-        return getUnit(it->second.second);
+}
 
-    if (!unitRangesCached) {
-        // Clang does not add debug_aranges.  If we fail to find the unit via
-        // the aranges, walk through all the units, and check out their
-        // DW_AT_range attribute, and fold its content into the aranges data.
-        unitRangesCached = true;
-        for (auto u : getUnits()) {
-            auto root = u->root();
-            auto lowpc = root.attribute(DW_AT_low_pc);
-            auto highpc = root.attribute(DW_AT_high_pc);
-            auto ranges = root.attribute(DW_AT_ranges);
-            if (lowpc.valid() && highpc.valid()) {
-                aranges.ranges[uintmax_t(highpc)] = std::make_pair(uintmax_t(highpc) - uintmax_t(lowpc), u->offset);
+/*
+ * The hash used by .debug_names: DJB's, over the case-folded name. We only
+ * fold ASCII, which covers any identifier we are likely to look up.
+ */
+static uint32_t
+debugNamesHash(const std::string &name)
+{
+    uint32_t hash = 5381;
+    for (unsigned char c : name)
+        hash = hash * 33 + (c < 0x80 ? tolower(c) : c);
+    return hash;
+}
+
+DebugNames::DebugNames(Reader::csptr io_, Reader::csptr strings_)
+    : io(std::move(io_))
+    , strings(std::move(strings_))
+{
+    if (!strings)
+        throw Exception() << "no .debug_str for .debug_names";
+    DWARFReader r(io);
+    while (!r.empty()) {
+        size_t offsetSize;
+        auto length = r.getlength(&offsetSize);
+        if (length == 0)
+            break;
+        Elf::Off next = r.getOffset() + length;
+        auto version = r.getu16();
+        if (version != 5)
+            throw Exception() << "unsupported .debug_names version " << version;
+        r.getu16(); // padding
+        Table table;
+        table.offsetSize = offsetSize;
+        table.compileUnits = r.getu32();
+        uint32_t localTypeUnits = r.getu32();
+        uint32_t foreignTypeUnits = r.getu32();
+        table.bucketCount = r.getu32();
+        table.nameCount = r.getu32();
+        uint32_t abbrevSize = r.getu32();
+        uint32_t augmentationSize = r.getu32();
+        r.skip((augmentationSize + 3) & ~3U);
+        for (size_t i = 0; i < table.compileUnits + localTypeUnits; ++i)
+            table.units.push_back(r.getuint(offsetSize));
+        r.skip(foreignTypeUnits * 8);
+
+        // The hash table is optional: without it, we just scan the names.
+        table.buckets = r.getOffset();
+        table.hashes = table.buckets + 4 * table.bucketCount;
+        table.stringOffsets = table.hashes + (table.bucketCount != 0 ? 4 * table.nameCount : 0);
+        table.entryOffsets = table.stringOffsets + offsetSize * table.nameCount;
+        Elf::Off abbrevs = table.entryOffsets + offsetSize * table.nameCount;
+        table.entries = abbrevs + abbrevSize;
+
+        r.setOffset(abbrevs);
+        for (;;) {
+            auto code = r.getuleb128();
+            if (code == 0)
+                break;
+            auto &abbrev = table.abbrevs[code];
+            abbrev.tag = Tag(r.getuleb128());
+            for (;;) {
+                auto idx = r.getuleb128();
+                auto form = r.getuleb128();
+                if (idx == 0 && form == 0)
+                    break;
+                abbrev.attrs.emplace_back(idx, Form(form));
             }
-            if (ranges.valid()) {
-                auto rs = rangesAt(uintmax_t(ranges));
-                for (auto r : rs) {
-                    aranges.ranges[r.second] = std::make_pair(r.first, u->offset);
+        }
+        tables.push_back(std::move(table));
+        r.setOffset(next);
+    }
+}
+
+/*
+ * Read the entry at "r". Returns false at the 0 that ends a name's entries.
+ */
+bool
+DebugNames::readEntry(const Table &table, DWARFReader &r, Entry &entry) const
+{
+    auto code = r.getuleb128();
+    if (code == 0)
+        return false;
+    auto abbrev = table.abbrevs.find(code);
+    if (abbrev == table.abbrevs.end())
+        throw Exception() << "no abbreviation " << code << " in .debug_names";
+    // Without a DW_IDX_compile_unit, the entry is in the table's only
+    // unit. Foreign type units index past the end of "units".
+    uintmax_t unit = table.compileUnits == 1 ? 0 : table.units.size();
+    uintmax_t die = 0;
+    bool haveDIE = false;
+    for (const auto &attr : abbrev->second.attrs) {
+        auto value = nameIndexValue(r, attr.second);
+        switch (attr.first) {
+            case DW_IDX_compile_unit:
+                unit = value;
+                break;
+            case DW_IDX_type_unit:
+                unit = table.compileUnits + value;
+                break;
+            case DW_IDX_die_offset:
+                die = value;
+                haveDIE = true;
+                break;
+            case DW_IDX_parent:
+                // DW_FORM_flag_present says the parent isn't indexed.
+                entry.haveParent = true;
+                if (attr.second != DW_FORM_flag_present)
+                    entry.parent = value;
+                break;
+        }
+    }
+    if (haveDIE && unit < table.units.size())
+        entry.die = table.units[unit] + die;
+    return true;
+}
+
+void
+DebugNames::readEntries(const Table &table, DWARFReader &r, std::vector<Match> &out) const
+{
+    for (Entry entry; readEntry(table, r, entry); entry = Entry()) {
+        if (entry.die == -1)
+            continue;
+        Match match { entry.die, entry.haveParent, {} };
+        // Follow the parents out to one that isn't indexed. Any nesting
+        // deeper than MAXDEPTH is surely a loop.
+        static const size_t MAXDEPTH = 64;
+        DWARFReader pr(io);
+        while (match.scoped && entry.parent != std::numeric_limits<uintmax_t>::max()) {
+            Entry parent;
+            if (match.scopes.size() == MAXDEPTH || entry.parent >= io->size() - table.entries) {
+                match.scoped = false;
+                break;
+            }
+            pr.setOffset(table.entries + entry.parent);
+            if (!readEntry(table, pr, parent) || parent.die == -1 || !parent.haveParent) {
+                match.scoped = false;
+                break;
+            }
+            match.scopes.push_back(parent.die);
+            entry = parent;
+        }
+        out.push_back(std::move(match));
+    }
+}
+
+void
+DebugNames::find(const std::string &name, std::vector<Match> &out) const
+{
+    auto hash = debugNamesHash(name);
+    DWARFReader r(io);
+    for (const auto &table : tables) {
+        auto matches = [&] (uint32_t i) {
+            r.setOffset(table.stringOffsets + i * table.offsetSize);
+            return strings->readString(r.getuint(table.offsetSize)) == name;
+        };
+        auto found = [&] (uint32_t i) {
+            r.setOffset(table.entryOffsets + i * table.offsetSize);
+            r.setOffset(table.entries + r.getuint(table.offsetSize));
+            readEntries(table, r, out);
+        };
+        if (table.bucketCount == 0) {
+            for (uint32_t i = 0; i < table.nameCount; ++i) {
+                if (matches(i)) {
+                    found(i);
+                    break;
                 }
             }
+            continue;
         }
+        // The bucket holds the index (from 1) of the first of its names, and
+        // the rest follow, until we reach a hash that's in another bucket.
+        uint32_t bucket = hash % table.bucketCount;
+        r.setOffset(table.buckets + 4 * bucket);
+        uint32_t first = r.getu32();
+        for (uint32_t i = first - 1; first != 0 && i < table.nameCount; ++i) {
+            r.setOffset(table.hashes + 4 * i);
+            uint32_t nameHash = r.getu32();
+            if (nameHash % table.bucketCount != bucket)
+                break;
+            if (nameHash == hash && matches(i)) {
+                found(i);
+                break;
+            }
+        }
+    }
+}
+
+GdbIndex::GdbIndex(Reader::csptr io_)
+    : io(std::move(io_))
+{
+    DWARFReader r(io);
+    // Older versions differ in their hash function and symbol table: gdb
+    // itself no longer uses them.
+    version = r.getu32();
+    if (version < 7 || version > 8)
+        throw Exception() << "unsupported .gdb_index version " << version;
+    Elf::Off unitList = r.getu32();
+    Elf::Off typeUnitList = r.getu32();
+    r.getu32(); // address area
+    symbols = r.getu32();
+    constants = r.getu32();
+    if (unitList > typeUnitList || symbols > constants || constants > Elf::Off(io->size()))
+        throw Exception() << "malformed .gdb_index header";
+    r.setOffset(unitList);
+    for (Elf::Off off = unitList; off + 16 <= typeUnitList; off += 16) {
+        units.push_back(r.getuint(8));
+        r.getuint(8); // length
     }
+    slots = (constants - symbols) / 8;
+    if ((slots & (slots - 1)) != 0)
+        throw Exception() << ".gdb_index has " << slots << " slots, not a power of two";
+}
 
-    // Try again now we've added all the unit ranges.
-    it = aranges.ranges.upper_bound(addr);
-    if (it != aranges.ranges.end() && it->first - it->second.first <= addr)
-        return getUnit(it->second.second);
+void
+GdbIndex::find(const std::string &name, std::vector<off_t> &out) const
+{
+    if (slots == 0)
+        return;
+    // gdb's mapped_index_string_hash, and its probe sequence.
+    uint32_t hash = 0;
+    for (unsigned char c : name)
+        hash = hash * 67 + tolower(c) - 113;
+    uint32_t mask = slots - 1;
+    uint32_t step = ((hash * 17) & mask) | 1;
+    DWARFReader r(io);
+    for (uint32_t slot = hash & mask, probes = 0; probes < slots;
+          slot = (slot + step) & mask, ++probes) {
+        r.setOffset(symbols + slot * 8);
+        uint32_t nameOff = r.getu32();
+        uint32_t unitsOff = r.getu32();
+        if (nameOff == 0 && unitsOff == 0)
+            return;
+        if (io->readString(constants + nameOff) != name)
+            continue;
+        r.setOffset(constants + unitsOff);
+        for (uint32_t count = r.getu32(); count != 0; --count) {
+            // The low 24 bits are the unit's index (type units follow the
+            // compile units): the rest describe the symbol.
+            uint32_t unit = r.getu32() & 0xffffff;
+            if (unit < units.size() && (out.empty() || out.back() != units[unit]))
+                out.push_back(units[unit]);
+        }
+        return;
+    }
+}
+
+/*
+ * Add the address ranges of a unit from its root DIE, for units that have no
+ * entry in .debug_aranges. Forms we can't resolve without more context (like
+ * DWARF 5's indexed addresses and range lists) are skipped.
+ */
+void
+Info::addUnitRanges(const Unit::sptr &u, ARanges &out) const
+{
+    auto root = u->root();
+    auto low = root.attribute(DW_AT_low_pc, true);
+    auto high = root.attribute(DW_AT_high_pc, true);
+    auto ranges = root.attribute(DW_AT_ranges, true);
+    Elf::Addr base = 0;
+    if (low.valid() && low.form() == DW_FORM_addr) {
+        base = uintmax_t(low);
+        if (high.valid()) {
+            switch (high.form()) {
+                case DW_FORM_addr:
+                    out.add(base, uintmax_t(high), u->offset);
+                    break;
+                case DW_FORM_data1:
+                case DW_FORM_data2:
+                case DW_FORM_data4:
+                case DW_FORM_data8:
+                case DW_FORM_udata:
+                    out.add(base, base + uintmax_t(high), u->offset);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    if (ranges.valid() && ranges.form() == DW_FORM_sec_offset && hasRanges()) {
+        for (auto &r : rangesAt(uintmax_t(ranges))) {
+            if (r.first == std::numeric_limits<Elf::Addr>::max())
+                base = r.second; // base address selection entry.
+            else
+                out.add(r.first + base, r.second + base, u->offset);
+        }
+    }
+}
+
+/*
+ * Replace the address ranges with those from a saved index, if there is one.
+ */
+bool
+Info::loadRanges(const char *kind, uint64_t source) const
+{
+    auto path = imageCache.indexPath(*elf, kind);
+    if (path == "")
+        return false;
+    auto file = Elf::IndexFile::open(path, source);
+    std::vector<Elf::Addr> starts, ends;
+    std::vector<off_t> units;
+    if (!file || !file->get(0, starts) || !file->get(1, ends) || !file->get(2, units)
+          || starts.size() != ends.size() || starts.size() != units.size())
+        return false;
+    for (auto unit : units)
+        if (unit < 0 || unit >= io->size())
+            return false;
+    aranges = ARanges();
+    for (size_t i = 0; i < starts.size(); ++i)
+        aranges.add(starts[i], ends[i], units[i]);
+    aranges.index();
+    return true;
+}
+
+void
+Info::saveRanges(const char *kind, uint64_t source) const
+{
+    auto path = imageCache.indexPath(*elf, kind);
+    if (path == "")
+        return;
+    std::vector<Elf::Addr> starts, ends;
+    std::vector<off_t> units;
+    for (const auto &range : aranges.all()) {
+        starts.push_back(range.start);
+        ends.push_back(range.end);
+        units.push_back(range.unit);
+    }
+    Elf::IndexFile::save(path, source, {
+          { starts.data(), starts.size() * sizeof (Elf::Addr) },
+          { ends.data(), ends.size() * sizeof (Elf::Addr) },
+          { units.data(), units.size() * sizeof (off_t) } });
+}
+
+void
+Info::loadARanges() const
+{
+    if (arangesh) {
+        if (!loadRanges("unitaddrs", arangesh->size())) {
+            DWARFReader r(arangesh);
+            while (!r.empty())
+                decodeARangeSet(r);
+            aranges.index();
+            saveRanges("unitaddrs", arangesh->size());
+        }
+        arangesh = nullptr;
+    }
+}
+
+Unit::sptr
+Info::lookupUnit(Elf::Addr addr) const {
+    loadARanges();
+    auto unit = aranges.find(addr);
+    if (unit != -1)
+        return getUnit(unit);
+
+    if (!unitRangesCached) {
+        // Clang does not add debug_aranges, and other producers may leave
+        // some units out. If we fail to find the unit via the aranges, add
+        // the ranges from the root DIEs of the units the aranges don't
+        // cover. The result is saved (along with the aranges already found)
+        // so later runs need not walk the units again.
+        unitRangesCached = true;
+        uint64_t source = io ? io->size() : 0;
+        if (!loadRanges("unitaddrs-all", source)) {
+            std::vector<off_t> covered;
+            for (const auto &range : aranges.all())
+                covered.push_back(range.unit);
+            std::sort(covered.begin(), covered.end());
+            for (auto u : getUnits())
+                if (!std::binary_search(covered.begin(), covered.end(), u->offset))
+                    addUnitRanges(u, aranges);
+            aranges.index();
+            saveRanges("unitaddrs-all", source);
+        }
+        unit = aranges.find(addr);
+        if (unit != -1)
+            return getUnit(unit);
+    }
     return nullptr;
+}
 
+std::shared_ptr<const LineInfo>
+Info::indexedLines(off_t offset) const
+{
+    auto it = unitLines.find(offset);
+    return it != unitLines.end() ? it->second : nullptr;
 }
 
-Info::~Info() = default;
+/*
+ * Decode each unit's root DIE, address ranges and line table across a pool
+ * of threads. The units are found by a quick pass over their headers, and
+ * each worker decodes its units into Unit objects of its own, so the only
+ * shared state is the readers. The ranges complete the index used by
+ * lookupUnit, and the line tables are kept for Unit::getLines to share, so
+ * later lookups need not decode any of this again. Only DWARF 2 to 4 units
+ * are indexed: others are left to be decoded as they are used. As it updates
+ * the Info's lazily built state, call this before using the Info elsewhere.
+ */
+void
+Info::indexUnits(unsigned jobs) const
+{
+    if (!io)
+        return;
+    std::vector<off_t> offsets;
+    try {
+        for (off_t off = 0; off < off_t(io->size()); ) {
+            DWARFReader r(io, off);
+            size_t dwarfLen;
+            auto length = r.getlength(&dwarfLen);
+            if (length == 0 || length > io->size() - r.getOffset())
+                throw (Exception() << "bad length for unit at offset " << off);
+            offsets.push_back(off);
+            off = r.getOffset() + length;
+        }
+    }
+    catch (const std::exception &ex) {
+        // Index the units before the bad header, and leave the rest.
+        if (verbose)
+            *debug << "can't find all units to index in " << *io << ": " << ex.what() << "\n";
+    }
+
+    struct Indexed {
+        bool done = false;
+        ARanges ranges;
+        std::shared_ptr<const LineInfo> lines;
+    };
+    std::vector<Indexed> indexed(offsets.size());
+    std::atomic<size_t> next(0);
+    auto work = [this, &offsets, &indexed, &next] () {
+        for (size_t i; (i = next++) < offsets.size(); ) {
+            try {
+                DWARFReader r(io, offsets[i]);
+                auto unit = make_shared<Unit>(this, r);
+                if (unit->version >= 5)
+                    continue;
+                addUnitRanges(unit, indexed[i].ranges);
+                unit->getLines();
+                indexed[i].lines = unit->lines;
+                indexed[i].done = true;
+            }
+            catch (const std::exception &) {
+                // Leave it to be decoded, and the error reported, on use.
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(size_t(jobs), offsets.size()); ++i)
+        pool.emplace_back(work);
+    work();
+    for (auto &worker : pool)
+        worker.join();
+
+    // Add the ranges of units .debug_aranges doesn't cover, as lookupUnit
+    // would, and if every unit was indexed, it need never walk them itself.
+    loadARanges();
+    std::vector<off_t> covered;
+    for (const auto &range : aranges.all())
+        covered.push_back(range.unit);
+    std::sort(covered.begin(), covered.end());
+    bool all = true;
+    {
+        std::lock_guard<std::mutex> guard(units.lock);
+        for (size_t i = 0; i < offsets.size(); ++i) {
+            units.byOffset[offsets[i]]; // note where each unit starts.
+            if (!indexed[i].done) {
+                all = false;
+                continue;
+            }
+            if (!std::binary_search(covered.begin(), covered.end(), offsets[i]))
+                for (const auto &range : indexed[i].ranges.all())
+                    aranges.add(range.start, range.end, range.unit);
+            if (indexed[i].lines)
+                unitLines[offsets[i]] = indexed[i].lines;
+        }
+    }
+    aranges.index();
+    if (all)
+        unitRangesCached = true;
+    if (verbose >= 2)
+        *debug << "indexed " << unitLines.size() << " line tables of "
+            << offsets.size() << " units in " << *io << " with " << jobs
+            << " threads" << std::endl;
+}
+
+Info::~Info()
+{
+    if (verbose >= 2 && units.misses != 0)
+        *debug << "unit cache for " << *elf->io << ": hits=" << units.hits
+            << ", misses=" << units.misses << ", evictions=" << units.evictions
+            << ", bytes=" << units.bytes << std::endl;
+}
 
 Unit::Unit(const Info *di, DWARFReader &r)
     : dwarf(di)
@@ -400,6 +1323,11 @@ Unit::Unit(const Info *di, DWARFReader &r)
         abbreviations.emplace(std::piecewise_construct,
                 std::forward_as_tuple(code),
                 std::forward_as_tuple(abbR));
+    abbreviationBytes = 0;
+    for (const auto &abbrev : abbreviations)
+        abbreviationBytes += sizeof abbrev + 2 * sizeof (void *)
+              + abbrev.second.forms.capacity() * sizeof (FormEntry)
+              + abbrev.second.extended.capacity() * sizeof abbrev.second.extended[0];
     topDIEOffset = r.getOffset();
     r.setOffset(end);
 }
@@ -415,10 +1343,17 @@ std::shared_ptr<RawDIE>
 Unit::offsetToRawDIE(const DIE &parent, off_t offset) {
     if (offset == 0 || offset < this->offset || offset >= this->end)
         return nullptr;
-    auto &rawptr = allEntries[offset];
-    if (rawptr == nullptr)
-        rawptr = decodeEntry(parent, offset);
-    return rawptr;
+    if (arena == nullptr)
+        arena = make_shared<DIEArena>();
+    auto raw = arena->find(offset);
+    if (raw == nullptr) {
+        raw = decodeEntry(parent, offset);
+        if (raw == nullptr)
+            return nullptr;
+        arena->insert(offset, raw);
+    }
+    // The DIE keeps the whole arena alive, not just its own RawDIE.
+    return std::shared_ptr<RawDIE>(arena, raw);
 }
 
 DIE
@@ -437,13 +1372,30 @@ Unit::name()
     return root().name();
 }
 
+size_t
+Unit::entryCount() const
+{
+    return arena ? arena->size() : 0;
+}
+
+size_t
+Unit::footprint() const
+{
+    return sizeof *this + abbreviationBytes
+        + (arena ? arena->footprint() : 0) + lineBytes;
+}
+
 Unit::~Unit() = default;
 
+const size_t Abbreviation::DIRECT;
+const uint16_t Abbreviation::NONE;
+
 Abbreviation::Abbreviation(DWARFReader &r)
     : tag(Tag(r.getuleb128()))
     , hasChildren(HasChildren(r.getu8()) == DW_CHILDREN_yes)
     , nextSibIdx(-1)
 {
+    direct.fill(NONE);
     for (size_t i = 0;; ++i) {
         auto name = AttrName(r.getuleb128());
         auto form = Form(r.getuleb128());
@@ -452,20 +1404,33 @@ Abbreviation::Abbreviation(DWARFReader &r)
         if (name == DW_AT_sibling)
             nextSibIdx = int(i);
         intmax_t value = (form == DW_FORM_implicit_const) ? r.getsleb128() : 0;
-        forms.emplace_back(form, value);
-        attrName2Idx[name] = i;
+        forms.emplace_back(name, form, value);
+        if (size_t(name) < DIRECT)
+            direct[name] = uint16_t(i);
+        else
+            extended.emplace_back(name, uint16_t(i));
     }
+    // Stable, so if an attribute appears twice, the last one is found, as
+    // it is for those in the direct table.
+    std::stable_sort(extended.begin(), extended.end(),
+          [] (const std::pair<AttrName, uint16_t> &l, const std::pair<AttrName, uint16_t> &r) {
+              return l.first < r.first; });
+}
+
+const FormEntry *
+Abbreviation::findExtended(AttrName name) const
+{
+    auto it = std::upper_bound(extended.begin(), extended.end(), name,
+          [] (AttrName n, const std::pair<AttrName, uint16_t> &ent) { return n < ent.first; });
+    if (it == extended.begin() || (--it)->first != name)
+        return nullptr;
+    return &forms[it->second];
 }
 
 AttrName
 Attribute::name() const
 {
-    size_t off = formp - &dieref.raw->type->forms[0];
-    for (auto ent : dieref.raw->type->attrName2Idx) {
-        if (ent.second == off)
-            return ent.first;
-    }
-    return DW_AT_none;
+    return formp->name;
 }
 
 Attribute::operator intmax_t() const
@@ -523,7 +1488,95 @@ LineState::LineState(LineInfo *li)
 static void
 dwarfStateAddRow(LineInfo *li, const LineState &state)
 {
-    li->matrix.push_back(state);
+    li->matrix.add(state, *li);
+}
+
+void
+LineInfo::Matrix::add(const LineState &state, const LineInfo &info)
+{
+    addr.push_back(state.addr);
+    file.push_back(state.file - info.files.data());
+    line.push_back(state.line);
+    column.push_back(state.column);
+    flags.push_back((state.is_stmt ? LINE_IS_STMT : 0)
+          | (state.basic_block ? LINE_BASIC_BLOCK : 0)
+          | (state.end_sequence ? LINE_END_SEQUENCE : 0)
+          | (state.prologue_end ? LINE_PROLOGUE_END : 0)
+          | (state.epilogue_begin ? LINE_EPILOGUE_BEGIN : 0));
+}
+
+/*
+ * Split the matrix into runs of ascending addresses, and sort them, so we
+ * can find the row for an address by binary search.
+ */
+void
+LineInfo::index()
+{
+    const auto &addr = matrix.addr;
+    for (size_t first = 0; first < matrix.size(); ) {
+        size_t last = first;
+        while (last + 1 < matrix.size() && (matrix.flags[last] & LINE_END_SEQUENCE) == 0
+              && addr[last + 1] >= addr[last])
+            ++last;
+        if (addr[last] > addr[first])
+            runs.push_back({ addr[first], addr[last], uint32_t(first), uint32_t(last) });
+        first = last + 1;
+    }
+    std::sort(runs.begin(), runs.end(), [] (const Run &l, const Run &r) {
+          return l.start < r.start || (l.start == r.start && l.first < r.first); });
+    maxEnd.resize(runs.size());
+    Elf::Addr highest = 0;
+    for (size_t i = 0; i < runs.size(); ++i)
+        maxEnd[i] = highest = std::max(highest, runs[i].end);
+}
+
+size_t
+LineInfo::findRow(Elf::Addr a) const
+{
+    size_t row = NOROW;
+    auto it = std::upper_bound(runs.begin(), runs.end(), a,
+          [] (Elf::Addr a, const Run &run) { return a < run.start; });
+    // Runs before this start at or below "a". Walk back while any of them
+    // might still reach it, to find the first row that contains it.
+    for (size_t i = it - runs.begin(); i != 0 && maxEnd[i - 1] > a; --i) {
+        const auto &run = runs[i - 1];
+        if (run.end <= a)
+            continue;
+        auto rowAddr = std::upper_bound(matrix.addr.begin() + run.first,
+              matrix.addr.begin() + run.last, a) - 1;
+        row = std::min(row, size_t(rowAddr - matrix.addr.begin()));
+    }
+    return row;
+}
+
+const FileEntry &
+LineInfo::fileAt(size_t row) const
+{
+    static const FileEntry unknown("", "", 0, 0);
+    auto idx = matrix.file[row];
+    if (idx < files.size())
+        return files[idx];
+    return files.empty() ? unknown : files[0];
+}
+
+size_t
+LineInfo::footprint() const
+{
+    size_t bytes = sizeof *this
+        + matrix.addr.capacity() * sizeof (Elf::Addr)
+        + (matrix.file.capacity() + matrix.line.capacity() + matrix.column.capacity())
+              * sizeof (uint32_t)
+        + matrix.flags.capacity()
+        + runs.capacity() * sizeof (Run)
+        + maxEnd.capacity() * sizeof (Elf::Addr)
+        + opcode_lengths.capacity() * sizeof (int)
+        + directories.capacity() * sizeof (std::string)
+        + files.capacity() * sizeof (FileEntry);
+    for (const auto &dir : directories)
+        bytes += dir.capacity();
+    for (const auto &file : files)
+        bytes += file.name.capacity() + file.directory.capacity();
+    return bytes;
 }
 
 void
@@ -666,6 +1719,7 @@ LineInfo::build(DWARFReader &r, const Unit *unit)
             }
         }
     }
+    index();
 }
 
 FileEntry::FileEntry(string name_, string dir_, unsigned lastMod_, unsigned length_)
@@ -817,21 +1871,21 @@ RawDIE::readValue(DWARFReader &r, const FormEntry &forment, Value &value, Unit *
         break;
 
     case DW_FORM_block1:
-        value.block = new Block();
+        value.block = new (unit->arena->allocate(sizeof (Block))) Block();
         value.block->length = r.getu8();
         value.block->offset = r.getOffset();
         r.skip(value.block->length);
         break;
 
     case DW_FORM_block2:
-        value.block = new Block();
+        value.block = new (unit->arena->allocate(sizeof (Block))) Block();
         value.block->length = r.getu16();
         value.block->offset = r.getOffset();
         r.skip(value.block->length);
         break;
 
     case DW_FORM_block4:
-        value.block = new Block();
+        value.block = new (unit->arena->allocate(sizeof (Block))) Block();
         value.block->length = r.getu32();
         value.block->offset = r.getOffset();
         r.skip(value.block->length);
@@ -839,7 +1893,7 @@ RawDIE::readValue(DWARFReader &r, const FormEntry &forment, Value &value, Unit *
 
     case DW_FORM_exprloc:
     case DW_FORM_block:
-        value.block = new Block();
+        value.block = new (unit->arena->allocate(sizeof (Block))) Block();
         value.block->length = r.getuleb128();
         value.block->offset = r.getOffset();
         r.skip(value.block->length);
@@ -872,26 +1926,6 @@ RawDIE::readValue(DWARFReader &r, const FormEntry &forment, Value &value, Unit *
     }
 }
 
-RawDIE::~RawDIE()
-{
-    stats.delone();
-    int i = 0;
-    for (auto &forment : type->forms) {
-        switch (forment.form) {
-            case DW_FORM_exprloc:
-            case DW_FORM_block:
-            case DW_FORM_block1:
-            case DW_FORM_block2:
-            case DW_FORM_block4:
-                delete values[i].block;
-                break;
-            default:
-                break;
-        }
-        ++i;
-    }
-}
-
 const LineInfo *
 Unit::getLines()
 {
@@ -901,6 +1935,10 @@ Unit::getLines()
     if (dwarf->lineshdr == nullptr)
         return nullptr;
 
+    lines = dwarf->indexedLines(offset);
+    if (lines != nullptr)
+        return lines.get();
+
     const auto &r = root();
     if (r.tag() != DW_TAG_partial_unit && r.tag() != DW_TAG_compile_unit)
         return nullptr; // XXX: assert?
@@ -911,18 +1949,21 @@ Unit::getLines()
 
     auto stmts = off_t(attr);
     DWARFReader r2(dwarf->lineshdr, stmts);
-    lines.reset(new LineInfo());
-    lines->build(r2, this);
+    auto built = std::make_shared<LineInfo>();
+    built->build(r2, this);
+    lineBytes = built->footprint();
+    lines = built;
     return lines.get();
 }
 
 RawDIE::RawDIE(Unit *unit, DWARFReader &r, size_t abbrev, off_t parent_)
     : type(unit->findAbbreviation(abbrev))
-    , values(type->forms.size())
+    , values(unit->arena->allocate<Value>(type->forms.size()))
     , parent(parent_)
     , firstChild(0)
     , nextSibling(0)
 {
+    std::fill_n(values, type->forms.size(), Value{});
     size_t i = 0;
     for (auto &form : type->forms) {
         readValue(r, form, values[i], unit);
@@ -947,7 +1988,7 @@ Unit::findAbbreviation(size_t code) const
     return it != abbreviations.end() ? &it->second : nullptr;
 }
 
-std::shared_ptr<RawDIE>
+RawDIE *
 Unit::decodeEntry(const DIE &parent, off_t offset)
 {
     DWARFReader r(io, offset);
@@ -959,22 +2000,19 @@ Unit::decodeEntry(const DIE &parent, off_t offset)
             parent.raw->nextSibling = r.getOffset();
         return nullptr;
     }
-    return std::make_shared<RawDIE>(this, r, abbrev, parent.getOffset());
+    return new (arena->allocate(sizeof (RawDIE))) RawDIE(this, r, abbrev, parent.getOffset());
 }
 
 void
 Unit::purge()
 {
-    auto start = stats.currentDIEs;
-    {
-        AllEntries destroy;
-        std::swap(allEntries, destroy);
-    }
-    auto end = stats.currentDIEs;
+    int start = stats.currentDIEs;
+    arena = nullptr;
+    int end = stats.currentDIEs;
     if (verbose >= 3)
         *debug << "purging " << name() << " in " << *dwarf->elf->io
                   << " freed " << start - end << " DIEs (total now "
-                  << stats.currentDIEs << ")" << std::endl;
+                  << end << ")" << std::endl;
 }
 
 string
@@ -1036,8 +2074,7 @@ CFI::decodeAddress(DWARFReader &f, int encoding) const
         base = f.getint(sizeof (Elf::Word));
         break;
     default:
-        abort();
-        break;
+        throw (Exception() << "unsupported pointer encoding " << encoding);
     }
 
     switch (encoding & 0xf0) {
@@ -1071,7 +2108,7 @@ DWARFReader::getlength(size_t *addrLen)
 }
 
 Elf::Off
-CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff)
+CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff) const
 {
     size_t addrLen;
     Elf::Off length = r.getlength(&addrLen);
@@ -1087,19 +2124,143 @@ CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff)
 }
 
 bool
-CFI::isCIE(Elf::Addr cieid)
+CFI::isCIE(Elf::Addr cieid) const
 {
     return (type == FI_DEBUG_FRAME && cieid == 0xffffffff) || (type == FI_EH_FRAME && cieid == 0);
 }
 
-CFI::CFI(Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_)
+CFI::CFI(Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_,
+      Reader::csptr hdr, Elf::Addr hdrAddr, const std::string &indexPath)
     : dwarf(info)
     , sectionAddr(addr)
     , io(std::move(io_))
     , type(type_)
+    , lazy(false)
 {
+    if (indexPath != "" && loadIndex(indexPath)) {
+        lazy = true;
+        return;
+    }
+    if (hdr) {
+        try {
+            DWARFReader hdrReader(hdr);
+            lazy = readHeaderTable(hdrReader, hdrAddr);
+        }
+        catch (const Exception &ex) {
+            *debug << "can't use .eh_frame_hdr: " << ex.what() << "\n";
+            fdeIndex = FDEIndex();
+        }
+    }
+    if (!lazy) {
+        decodeAll();
+        for (const auto &fde : fdes)
+            fdeIndex.add(fde.second.iloc, fde.second.irange, fde.first);
+        fdeIndex.sort();
+    }
+    if (indexPath != "")
+        Elf::IndexFile::save(indexPath, io->size(), {
+              { fdeIndex.iloc.data(), fdeIndex.size() * sizeof (Elf::Addr) },
+              { fdeIndex.irange.data(), fdeIndex.size() * sizeof (Elf::Addr) },
+              { fdeIndex.offset.data(), fdeIndex.size() * sizeof (Elf::Off) } });
+}
+
+/*
+ * Load the FDE index saved by an earlier run. FDEs are then decoded on demand,
+ * as with an index from .eh_frame_hdr.
+ */
+bool
+CFI::loadIndex(const std::string &path)
+{
+    auto file = Elf::IndexFile::open(path, io->size());
+    // The FDEs must lie in the section, and be sorted for findFDE.
+    auto valid = [this] {
+        for (size_t i = 0; i < fdeIndex.size(); ++i)
+            if (fdeIndex.offset[i] >= Elf::Off(io->size())
+                  || (i != 0 && fdeIndex.iloc[i] < fdeIndex.iloc[i - 1]))
+                return false;
+        return true;
+    };
+    if (file && file->get(0, fdeIndex.iloc) && file->get(1, fdeIndex.irange)
+          && file->get(2, fdeIndex.offset) && fdeIndex.irange.size() == fdeIndex.size()
+          && fdeIndex.offset.size() == fdeIndex.size() && valid()) {
+        fdeIndex.index();
+        if (verbose > 1)
+            *debug << "loaded " << fdeIndex.size() << " FDEs from " << path << "\n";
+        return true;
+    }
+    fdeIndex = FDEIndex();
+    return false;
+}
+
+/*
+ * Populate the FDE index from the binary search table in .eh_frame_hdr. The
+ * table gives each FDE's start address and location, but not its length, so
+ * the range is left open, and checked when the FDE itself is decoded.
+ */
+bool
+CFI::readHeaderTable(DWARFReader &hdr, Elf::Addr hdrAddr)
+{
+    if (hdr.getu8() != 1)
+        return false;
+    int ptrEncoding = hdr.getu8();
+    int countEncoding = hdr.getu8();
+    int tableEncoding = hdr.getu8();
+    if (ptrEncoding == DW_EH_PE_omit || countEncoding == DW_EH_PE_omit ||
+          tableEncoding == DW_EH_PE_omit)
+        return false;
+
+    // "pcrel" values are relative to the field itself, "datarel" values to
+    // the start of the header.
+    auto decode = [this, &hdr, hdrAddr] (int encoding) -> Elf::Addr {
+        Elf::Addr fieldAddr = hdrAddr + hdr.getOffset();
+        Elf::Addr value = decodeAddress(hdr, encoding & 0xf);
+        switch (encoding & 0x70) {
+            case 0:
+                return value;
+            case DW_EH_PE_pcrel:
+                return value + fieldAddr;
+            case DW_EH_PE_datarel:
+                return value + hdrAddr;
+            default:
+                throw (Exception() << "unsupported pointer encoding " << encoding);
+        }
+    };
+
+    Elf::Addr ehFrameAddr = decode(ptrEncoding);
+    if (ehFrameAddr != sectionAddr)
+        return false;
+    Elf::Addr count = decode(countEncoding);
+    // Each entry is two encoded values, of at least a byte each.
+    if (count > (hdr.getLimit() - hdr.getOffset()) / 2)
+        throw (Exception() << "FDE count " << count << " overruns .eh_frame_hdr");
+    fdeIndex.iloc.reserve(count);
+    fdeIndex.irange.reserve(count);
+    fdeIndex.offset.reserve(count);
+    bool sorted = true;
+    for (Elf::Addr i = 0; i < count; ++i) {
+        Elf::Addr loc = decode(tableEncoding);
+        Elf::Addr fdeAddr = decode(tableEncoding);
+        if (!fdeIndex.iloc.empty() && loc < fdeIndex.iloc.back())
+            sorted = false;
+        fdeIndex.add(loc, std::numeric_limits<Elf::Addr>::max(), fdeAddr - sectionAddr);
+    }
+    if (!sorted)
+        fdeIndex.sort();
+    else
+        fdeIndex.index();
+    if (verbose > 1)
+        *debug << "indexed " << count << " FDEs from .eh_frame_hdr\n";
+    return true;
+}
+
+/*
+ * Decode every CIE and FDE in the section.
+ */
+void
+CFI::decodeAll() const
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
     DWARFReader reader(io);
-    // decode in 2 passes: first for CIE, then for FDE
     off_t nextoff;
     for (; !reader.empty();  reader.setOffset(nextoff)) {
         size_t startOffset = reader.getOffset();
@@ -1107,53 +2268,159 @@ CFI::CFI(Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_)
         nextoff = decodeCIEFDEHdr(reader, type, &associatedCIE);
         if (nextoff == 0)
             break;
-        auto ensureCIE = [this, &reader, nextoff] (Elf::Off offset) {
+        if (associatedCIE == Elf::Off(-1)) {
             // This is in fact a CIE - add it in if we have not seen it yet.
-            if (cies.find(offset) != cies.end())
-                return;
-            cies.emplace(std::piecewise_construct,
-                        std::forward_as_tuple(offset),
+            if (cies.find(startOffset) == cies.end())
+                cies.emplace(std::piecewise_construct,
+                        std::forward_as_tuple(startOffset),
                         std::forward_as_tuple(this, reader, nextoff));
-        };
-        if (associatedCIE == Elf::Off(-1)) {
-            ensureCIE(startOffset);
-        } else {
-            // Make sure we have the associated CIE.
-            ensureCIE(associatedCIE);
-            fdeList.emplace_back(this, reader, associatedCIE, nextoff);
+        } else if (fdes.find(startOffset) == fdes.end()) {
+            fdes.emplace(std::piecewise_construct,
+                        std::forward_as_tuple(startOffset),
+                        std::forward_as_tuple(this, reader, associatedCIE, nextoff));
         }
     }
 }
 
+const CIE &
+CFI::findCIE(Elf::Off offset) const
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    auto it = cies.find(offset);
+    if (it != cies.end())
+        return it->second;
+    DWARFReader reader(io, offset);
+    Elf::Off associatedCIE;
+    Elf::Off nextoff = decodeCIEFDEHdr(reader, type, &associatedCIE);
+    if (nextoff == 0 || nextoff > Elf::Off(io->size()) || associatedCIE != Elf::Off(-1))
+        throw (Exception() << "no CIE at offset " << offset);
+    return cies.emplace(std::piecewise_construct,
+                std::forward_as_tuple(offset),
+                std::forward_as_tuple(this, reader, nextoff)).first->second;
+}
+
+const FDE &
+CFI::fdeAtOffset(Elf::Off offset) const
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    auto it = fdes.find(offset);
+    if (it != fdes.end())
+        return it->second;
+    DWARFReader reader(io, offset);
+    Elf::Off associatedCIE;
+    Elf::Off nextoff = decodeCIEFDEHdr(reader, type, &associatedCIE);
+    if (nextoff == 0 || nextoff > Elf::Off(io->size()) || associatedCIE == Elf::Off(-1))
+        throw (Exception() << "no FDE at offset " << offset);
+    return fdes.emplace(std::piecewise_construct,
+                std::forward_as_tuple(offset),
+                std::forward_as_tuple(this, reader, associatedCIE, nextoff)).first->second;
+}
+
+const CallFrameTable &
+CFI::callFrameTable(const FDE &fde) const
+{
+    auto table = std::atomic_load(&fde.table);
+    if (!table) {
+        // If another thread compiles it first, use theirs.
+        std::shared_ptr<const CallFrameTable> compiled =
+            std::make_shared<CallFrameTable>(findCIE(fde.cieOff).compile(fde));
+        std::atomic_compare_exchange_strong(&fde.table, &table, compiled);
+        if (!table)
+            table = compiled;
+    }
+    return *table;
+}
+
 const FDE *
 CFI::findFDE(Elf::Addr addr) const
 {
-    for (const auto &fde : fdeList) {
-        if (fde.iloc <= addr && fde.iloc + fde.irange > addr)
-            return &fde;
+    auto off = fdeIndex.find(addr);
+    if (off == Elf::Off(-1))
+        return nullptr;
+    const FDE &fde = fdeAtOffset(off);
+    return addr - fde.iloc < fde.irange ? &fde : nullptr;
+}
+
+void
+FDEIndex::add(Elf::Addr loc, Elf::Addr range, Elf::Off off)
+{
+    iloc.push_back(loc);
+    irange.push_back(range);
+    offset.push_back(off);
+}
+
+void
+FDEIndex::sort()
+{
+    /*
+     * Order by start address. Empty FDEs can never match, and where two FDEs
+     * start at the same address, the one earliest in the section wins, as it
+     * did with a linear scan.
+     */
+    std::vector<size_t> order(iloc.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+          [this] (size_t l, size_t r) { return iloc[l] < iloc[r]; });
+
+    FDEIndex sorted;
+    sorted.iloc.reserve(order.size());
+    sorted.irange.reserve(order.size());
+    sorted.offset.reserve(order.size());
+    for (auto i : order) {
+        if (irange[i] == 0)
+            continue;
+        if (!sorted.iloc.empty() && sorted.iloc.back() == iloc[i])
+            continue;
+        sorted.add(iloc[i], irange[i], offset[i]);
     }
-    return nullptr;
+    *this = std::move(sorted);
+    index();
 }
 
-bool
-sourceFromAddrInUnit(const Unit::sptr &unit, Elf::Addr addr,
-        std::vector<std::pair<string, int>> &info) {
+void
+FDEIndex::index()
+{
+    // Ranges from .eh_frame_hdr are open-ended, so saturate rather than wrap.
+    maxEnd.resize(iloc.size());
+    Elf::Addr highest = 0;
+    for (size_t i = 0; i < iloc.size(); ++i) {
+        Elf::Addr end = iloc[i] + irange[i] < iloc[i]
+              ? std::numeric_limits<Elf::Addr>::max() : iloc[i] + irange[i];
+        maxEnd[i] = highest = std::max(highest, end);
+    }
+}
+
+Elf::Off
+FDEIndex::find(Elf::Addr addr) const
+{
+    // The nearest FDE starting at or below addr covers it unless it ends
+    // first: then an earlier, enclosing FDE might.
+    auto it = std::upper_bound(iloc.begin(), iloc.end(), addr);
+    for (size_t i = it - iloc.begin(); i > 0 && maxEnd[i - 1] > addr; --i)
+        if (addr - iloc[i - 1] < irange[i - 1])
+            return offset[i - 1];
+    return Elf::Off(-1);
+}
+
+void
+sourcesInUnit(const Unit::sptr &unit, const Elf::Addr *addrs, size_t count,
+        std::vector<std::pair<string, int>> *sources)
+{
     DIE d = unit->root();
-    if (d.containsAddress(addr) == ContainsAddr::NO)
-        return false;
-    auto lines = unit->getLines();
-    if (lines) {
-        for (auto i = lines->matrix.begin(); i != lines->matrix.end(); ++i) {
-            if (i->end_sequence)
-                continue;
-            auto next = i+1;
-            if (i->addr <= addr && next->addr > addr) {
-                info.emplace_back(i->file->name, i->line);
-                return true;
-            }
+    const LineInfo *lines = nullptr;
+    for (size_t i = 0; i < count; ++i) {
+        if (d.containsAddress(addrs[i]) == ContainsAddr::NO)
+            continue;
+        if (lines == nullptr) {
+            lines = unit->getLines();
+            if (lines == nullptr)
+                return;
         }
+        auto row = lines->findRow(addrs[i]);
+        if (row != LineInfo::NOROW)
+            sources[i].emplace_back(lines->fileAt(row).name, lines->matrix.line[row]);
     }
-    return false;
 }
 
 std::vector<std::pair<std::string, int>>
@@ -1166,7 +2433,8 @@ Info::sourceFromAddr(uintmax_t addr) const
 
     const auto &unit = lookupUnit(addr);
     if (unit) {
-        sourceFromAddrInUnit(unit, Elf::Addr(addr), info);
+        Elf::Addr elfAddr = addr;
+        sourcesInUnit(unit, &elfAddr, 1, &info);
     }
     return info;
 }
@@ -1199,31 +2467,96 @@ CallFrame::CallFrame()
 #endif
 }
 
-CallFrame
-CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
+/*
+ * Compile the CFA program for an FDE into its table of rows. The CIE's
+ * initial instructions give the starting rules, and the ones
+ * DW_CFA_restore returns to.
+ */
+CallFrameTable
+CIE::compile(const FDE &fde) const
+{
+    CallFrame dframe;
+    DWARFReader cieInsns(frameInfo->io, instructions, end);
+    execInsns(cieInsns, 0, CallFrame(), dframe,
+          [] (uintmax_t, uintmax_t, const CallFrame &) {});
+
+    CallFrameTable table;
+    table.end = fde.iloc + fde.irange;
+    CallFrame frame = dframe;
+    uintmax_t reached = fde.iloc;
+    DWARFReader r(frameInfo->io, fde.instructions, fde.end);
+    try {
+        execInsns(r, fde.iloc, dframe, frame,
+              [&table, &reached] (uintmax_t from, uintmax_t to, const CallFrame &rules) {
+                  table.add(from, rules);
+                  reached = to;
+              });
+    }
+    catch (const Exception &ex) {
+        // Keep the rows we decoded: addresses past them have no rules.
+        table.end = reached;
+        if (verbose)
+            *debug << "CFA program for FDE at " << std::hex << fde.iloc << std::dec
+                << " stopped early: " << ex.what() << "\n";
+    }
+    return table;
+}
+
+void
+CallFrameTable::add(Elf::Addr from, const CallFrame &frame)
+{
+    // A zero-length advance leaves nothing for the previous row to cover.
+    if (!start.empty() && start.back() >= from) {
+        rules.resize(rows.back().firstRule);
+        start.pop_back();
+        rows.pop_back();
+    }
+    start.push_back(from);
+    rows.push_back({ frame.cfaReg, frame.cfaValue, uint32_t(rules.size()),
+          uint32_t(frame.registers.size()) });
+    for (unsigned regno = 0; regno < MAXREG; ++regno) {
+        auto unwind = frame.registers.find(regno);
+        if (unwind)
+            rules.emplace_back(regno, *unwind);
+    }
+}
+
+const CallFrameRow *
+CallFrameTable::find(Elf::Addr addr) const
+{
+    if (addr >= end)
+        return nullptr;
+    auto it = std::upper_bound(start.begin(), start.end(), addr);
+    if (it == start.begin())
+        return nullptr;
+    return &rows[it - start.begin() - 1];
+}
+
+void
+CIE::execInsns(DWARFReader &r, uintmax_t addr, const CallFrame &dframe, CallFrame &frame,
+      const std::function<void(uintmax_t, uintmax_t, const CallFrame &)> &row) const
 {
     std::stack<CallFrame> stack;
-    CallFrame frame;
 
     uintmax_t offset;
     int reg, reg2;
 
-    // default frame for this CIE.
-    CallFrame dframe;
-    if (addr != 0 || wantAddr != 0) {
-        DWARFReader r2(r.io, instructions, end);
-        dframe = execInsns(r2, 0, 0);
-        frame = dframe;
-    }
-    while (addr <= wantAddr) {
-        if (r.empty())
-            return frame;
+    auto advance = [&addr, &frame, &row] (uintmax_t to) {
+        row(addr, to, frame);
+        addr = to;
+    };
+    auto restore = [&frame, &dframe] (int reg) {
+        auto unwind = dframe.registers.find(reg);
+        frame.registers[reg] = unwind ? *unwind : RegisterUnwind();
+    };
+
+    while (!r.empty()) {
         uint8_t rawOp = r.getu8();
         reg = rawOp &0x3f;
         auto op = CFAInstruction(rawOp & ~0x3f);
         switch (op) {
         case DW_CFA_advance_loc:
-            addr += reg * codeAlign;
+            advance(addr + reg * codeAlign);
             break;
 
         case DW_CFA_offset:
@@ -1232,10 +2565,9 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
             frame.registers[reg].u.offset = offset * dataAlign;
             break;
 
-        case DW_CFA_restore: {
-            frame.registers[reg] = dframe.registers[reg];
+        case DW_CFA_restore:
+            restore(reg);
             break;
-        }
 
         case 0:
             op = CFAInstruction(rawOp & 0x3f);
@@ -1244,19 +2576,19 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
                 break;
 
             case DW_CFA_set_loc:
-                addr = r.getuint(r.addrLen);
+                advance(r.getuint(r.addrLen));
                 break;
 
             case DW_CFA_advance_loc1:
-                addr += r.getu8() * codeAlign;
+                advance(addr + r.getu8() * codeAlign);
                 break;
 
             case DW_CFA_advance_loc2:
-                addr += r.getu16() * codeAlign;
+                advance(addr + r.getu16() * codeAlign);
                 break;
 
             case DW_CFA_advance_loc4:
-                addr += r.getu32() * codeAlign;
+                advance(addr + r.getu32() * codeAlign);
                 break;
 
             case DW_CFA_offset_extended:
@@ -1268,7 +2600,7 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
 
             case DW_CFA_restore_extended:
                 reg = r.getuleb128();
-                frame.registers[reg] = dframe.registers[reg];
+                restore(reg);
                 break;
 
             case DW_CFA_undefined:
@@ -1293,6 +2625,8 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
                 break;
 
             case DW_CFA_restore_state:
+                if (stack.empty())
+                    throw (Exception() << "DW_CFA_restore_state with no saved state");
                 frame = stack.top();
                 stack.pop();
                 break;
@@ -1364,23 +2698,22 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
             case DW_CFA_GNU_window_save:
             case DW_CFA_GNU_negative_offset_extended:
             default:
-                abort();
+                throw (Exception() << "unsupported CFA instruction " << int(rawOp));
             }
             break;
 
         default:
-            abort();
-            break;
+            throw (Exception() << "unsupported CFA instruction " << int(rawOp));
         }
     }
-    return frame;
+    row(addr, std::numeric_limits<uintmax_t>::max(), frame);
 }
 
-FDE::FDE(CFI *fi, DWARFReader &reader, Elf::Off cieOff_, Elf::Off endOff_)
+FDE::FDE(const CFI *fi, DWARFReader &reader, Elf::Off cieOff_, Elf::Off endOff_)
     : end(endOff_)
     , cieOff(cieOff_)
 {
-    auto &cie = fi->cies[cieOff];
+    auto &cie = fi->findCIE(cieOff);
     iloc = fi->decodeAddress(reader, cie.addressEncoding);
     irange = fi->decodeAddress(reader, cie.addressEncoding & 0xf);
     if (!cie.augmentation.empty() && cie.augmentation[0] == 'z') {
@@ -1452,6 +2785,8 @@ CIE::CIE(const CFI *fi, DWARFReader &r, Elf::Off end_)
         if (earlyExit)
             break;
     }
+    if (endaugdata > end || r.getOffset() > end)
+        throw (Exception() << "CIE augmentation overruns the CIE");
     if (r.getOffset() != endaugdata) {
         *debug << "warning: " << endaugdata - r.getOffset()
             << " bytes of augmentation ignored" << std::endl;
@@ -1599,9 +2934,9 @@ DIE::containsAddress(Elf::Addr addr) const
 Attribute
 DIE::attribute(AttrName name, bool local) const
 {
-    auto loc = raw->type->attrName2Idx.find(name);
-    if (loc != raw->type->attrName2Idx.end())
-        return Attribute(*this, &raw->type->forms.at(loc->second));
+    auto form = raw->type->find(name);
+    if (form != nullptr)
+        return Attribute(*this, form);
 
     // If we have attributes of any of these types, we can look for other
     // attributes in the referenced entry.
@@ -1630,15 +2965,23 @@ ImageCache::getDwarf(const string &filename)
 Info::sptr
 ImageCache::getDwarf(Elf::Object::sptr object)
 {
-    auto it = dwarfCache.find(object);
-    dwarfLookups++;
-    if (it != dwarfCache.end()) {
-        dwarfHits++;
-        return it->second;
+    Info::sptr dwarf;
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        auto it = dwarfCache.find(object);
+        dwarfLookups++;
+        if (it != dwarfCache.end()) {
+            dwarfHits++;
+            dwarf = it->second;
+        } else {
+            dwarf = make_shared<Info>(object, *this);
+            dwarfCache[object] = dwarf;
+        }
     }
-
-    auto dwarf = make_shared<Info>(object, *this);
-    dwarfCache[object] = dwarf;
+    // Index outside the lock, so other objects can be found meanwhile. Anyone
+    // else after this object waits here until it's indexed.
+    if (indexJobs != 0)
+        std::call_once(dwarf->indexed, [this, &dwarf] { dwarf->indexUnits(indexJobs); });
     return dwarf;
 }
 
@@ -1655,6 +2998,7 @@ ImageCache::~ImageCache() {
 void
 ImageCache::flush(Elf::Object::sptr o)
 {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     Elf::ImageCache::flush(o);
     dwarfCache.erase(o);
 }
@@ -1736,23 +3080,21 @@ DIEChildren::end() const {
 
 std::pair<AttrName, Attribute>
 DIEAttributes::const_iterator::operator *() const {
-    return std::make_pair(
-            rawIter->first,
-            Attribute(die, &die.raw->type->forms[rawIter->second]));
+    return std::make_pair(rawIter->name, Attribute(die, &*rawIter));
 }
 
 DIEAttributes::const_iterator
 DIEAttributes::begin() const {
-    return const_iterator(die, die.raw->type->attrName2Idx.begin());
+    return const_iterator(die, die.raw->type->forms.begin());
 }
 
 DIEAttributes::const_iterator
 DIEAttributes::end() const {
-    return const_iterator(die, die.raw->type->attrName2Idx.end());
+    return const_iterator(die, die.raw->type->forms.end());
 }
 
 const Value &Attribute::value() const {
-    return dieref.raw->values.at(formp - &dieref.raw->type->forms[0]);
+    return dieref.raw->values[formp - &dieref.raw->type->forms[0]];
 }
 
 Tag DIE::tag() const {
@@ -2,6 +2,8 @@
 #include "libpstack/elf.h"
 #include "libpstack/proc.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <limits>
 #include <stack>
@@ -306,7 +308,7 @@ ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *fra
 }
 
 Elf::Addr
-StackFrame::getCFA(const Process &proc, const CallFrame &dcf) const
+StackFrame::getCFA(const Process &proc, const CallFrameRow &dcf) const
 {
     switch (dcf.cfaValue.type) {
         case SAME:
@@ -333,7 +335,7 @@ StackFrame::getCFA(const Process &proc, const CallFrame &dcf) const
 }
 
 StackFrame *
-StackFrame::unwind(Process &p)
+StackFrame::unwind(Process &p, FrameArena &arena)
 {
     std::tie(elfReloc, elf, phdr) = p.findSegment(scopeIP());
     if (elf == nullptr)
@@ -352,7 +354,7 @@ StackFrame::unwind(Process &p)
                 fde = f->findFDE(objaddr);
                 if (fde != nullptr) {
                     frameInfo = f;
-                    cie = &f->cies[fde->cieOff];
+                    cie = &f->findCIE(fde->cieOff);
                     break;
                 }
             }
@@ -362,25 +364,34 @@ StackFrame::unwind(Process &p)
         throw (Exception() << "no FDE for instruction address "
               << std::hex << scopeIP() << std::dec << " in " << *elf->io);
 
-    DWARFReader r(frameInfo->io, fde->instructions, fde->end);
-
-    auto iter = dwarf->callFrameForAddr.find(objaddr);
-    if (iter == dwarf->callFrameForAddr.end())
-        dwarf->callFrameForAddr[objaddr] = cie->execInsns(r, fde->iloc, objaddr);
-
-    const CallFrame &dcf = dwarf->callFrameForAddr[objaddr];
+    const auto &table = frameInfo->callFrameTable(*fde);
+    const CallFrameRow *dcf = table.find(objaddr);
+    if (dcf == nullptr)
+        throw (Exception() << "no CFA rules for instruction address "
+              << std::hex << scopeIP() << std::dec << " in " << *elf->io);
+    auto rulesBegin = table.rules.begin() + dcf->firstRule;
+    auto rulesEnd = rulesBegin + dcf->ruleCount;
 
     // Given the registers available, and the state of the call unwind data,
     // calculate the CFA at this point.
-    cfa = getCFA(p, dcf);
-    auto rarInfo = dcf.registers.find(cie->rar);
+    cfa = getCFA(p, *dcf);
+    auto rarInfo = std::find_if(rulesBegin, rulesEnd,
+          [this] (const std::pair<int, RegisterUnwind> &rule) { return rule.first == cie->rar; });
 
-    auto out = new StackFrame(UnwindMechanism::DWARF);
+    // If we fail from here, "out" is left for the arena to clean up.
+    auto out = arena.make(UnwindMechanism::DWARF);
 #ifdef CFA_RESTORE_REGNO
     // "The CFA is defined to be the stack pointer in the calling frame."
     out->setReg(CFA_RESTORE_REGNO, cfa);
 #endif
-    for (auto &entry : dcf.registers) {
+    // Registers saved on the stack are all fetched in a single batch below.
+    // There's one rule per register, and we only read those we track.
+    std::array<std::pair<int, Elf::Addr>, MAXREG> saved; // XXX: assume addrLen = sizeof Elf_Addr
+    std::array<Reader::ReadRequest, MAXREG> savedReads;
+    size_t savedCount = 0;
+
+    for (auto it = rulesBegin; it != rulesEnd; ++it) {
+        const auto &entry = *it;
         const auto &unwind = entry.second;
         const int regno = entry.first;
         switch (unwind.type) {
@@ -389,9 +400,12 @@ StackFrame::unwind(Process &p)
                 out->setReg(regno, getReg(regno));
                 break;
             case OFFSET: {
-                Elf::Addr reg; // XXX: assume addrLen = sizeof Elf_Addr
-                p.io->readObj(cfa + unwind.u.offset, &reg);
-                out->setReg(regno, reg);
+                if (unsigned(regno) >= MAXREG || savedCount == MAXREG)
+                    break;
+                auto &slot = saved[savedCount];
+                slot.first = regno;
+                savedReads[savedCount++] = { off_t(cfa + unwind.u.offset),
+                      sizeof slot.second, (char *)&slot.second, 0 };
                 break;
             }
             case REG:
@@ -418,21 +432,41 @@ StackFrame::unwind(Process &p)
         }
     }
 
+    if (savedCount != 0) {
+        p.io->readBatch(&savedReads[0], savedCount);
+        for (size_t i = 0; i < savedCount; ++i) {
+            if (savedReads[i].result != savedReads[i].count) {
+                throw (Exception() << "incomplete object read from " << *p.io
+                      << " at offset " << savedReads[i].off
+                      << " for " << savedReads[i].count << " bytes");
+            }
+            out->setReg(saved[i].first, saved[i].second);
+        }
+    }
+
     // If the return address isn't defined, then we can't unwind.
-    if (rarInfo == dcf.registers.end() || rarInfo->second.type == UNDEF) {
+    if (rarInfo == rulesEnd || rarInfo->second.type == UNDEF) {
         if (verbose > 1) {
            *debug << "DWARF unwinding stopped at "
               << std::hex << scopeIP() << std::dec
-              << ": " << (rarInfo == dcf.registers.end() ?
+              << ": " << (rarInfo == rulesEnd ?
                     "no RAR register found" : "RAR register undefined")
               << std::endl;
         }
-        delete out;
         return nullptr;
     }
     return out;
 }
 
+void
+FrameArena::reset()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < used; ++i)
+        reinterpret_cast<StackFrame *>(&blocks[i / BLOCKSIZE][i % BLOCKSIZE])->~StackFrame();
+    used = 0;
+}
+
 void
 StackFrame::setReg(unsigned regno, cpureg_t regval)
 {
@@ -442,7 +476,7 @@ StackFrame::setReg(unsigned regno, cpureg_t regval)
 cpureg_t
 StackFrame::getReg(unsigned regno) const
 {
-    auto i = regs.find(regno);
-    return i != regs.end() ? i->second : 0;
+    auto reg = regs.find(regno);
+    return reg ? *reg : 0;
 }
 }
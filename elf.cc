@@ -7,9 +7,12 @@
 #endif
 #include "libpstack/util.h"
 
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <cerrno>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <limits>
@@ -173,6 +176,7 @@ Object::Object(ImageCache &cache, Reader::csptr io_)
     , lastSegmentForAddress(nullptr)
 {
     debugLoaded = false;
+    debugReady = false;
     int i;
     size_t off;
 
@@ -288,10 +292,9 @@ Object::Object(ImageCache &cache, Reader::csptr io_)
 const Phdr *
 Object::getSegmentForAddress(Off a) const
 {
-    if (lastSegmentForAddress != nullptr &&
-          lastSegmentForAddress->p_vaddr <= a &&
-          lastSegmentForAddress->p_vaddr + lastSegmentForAddress->p_memsz > a)
-       return lastSegmentForAddress;
+    const Phdr *last = lastSegmentForAddress;
+    if (last != nullptr && last->p_vaddr <= a && last->p_vaddr + last->p_memsz > a)
+       return last;
     const auto &hdrs = getSegments(PT_LOAD);
 
     auto pos = std::lower_bound(hdrs.begin(), hdrs.end(), a,
@@ -299,7 +302,7 @@ Object::getSegmentForAddress(Off a) const
             return header.p_vaddr + header.p_memsz <= addr; });
     if (pos != hdrs.end() && pos->p_vaddr <= a) {
         lastSegmentForAddress = &*pos;
-        return lastSegmentForAddress;
+        return &*pos;
     }
     return nullptr;
 }
@@ -323,6 +326,126 @@ Object::getInterpreter() const
     return "";
 }
 
+string
+Object::getBuildID() const
+{
+    for (const auto &note : notes) {
+        if (note.name() == "GNU" && note.type() == GNU_BUILD_ID) {
+            auto io = note.data();
+            std::vector<unsigned char> data(io->size());
+            io->readObj(0, &data[0], io->size());
+            std::ostringstream os;
+            os << std::hex << std::setfill('0');
+            for (auto c : data)
+                os << std::setw(2) << int(c);
+            return os.str();
+        }
+    }
+    return "";
+}
+
+/*
+ * Build the address index for a symbol table. Symbols in sections we can't
+ * see never match. Sized symbols must be in an allocated section, but
+ * zero-sized ones are kept for exact matches regardless.
+ */
+static_assert(sizeof (SymbolAddressIndex::Entry) == 2 * sizeof (Addr) + sizeof (Word) + 4,
+      "SymbolAddressIndex::Entry must have no implicit padding");
+
+std::unique_ptr<SymbolAddressIndex>
+Object::buildSymbolIndex(const Reader &symbols, const char *kind) const
+{
+    auto index = make_unique<SymbolAddressIndex>();
+    auto path = imageCache.indexPath(*this, kind);
+    if (path != "") {
+        auto file = IndexFile::open(path, symbols.size());
+        size_t count = symbols.size() / sizeof (Sym);
+        auto valid = [&] {
+            for (const auto &entry : index->entries)
+                if (entry.idx >= count)
+                    return false;
+            return true;
+        };
+        if (file && file->get(0, index->entries) && file->get(1, index->maxEnd)
+              && index->entries.size() == index->maxEnd.size() && valid()) {
+            if (verbose > 1)
+                *debug << "loaded " << kind << " index for " << *io << " from " << path << "\n";
+            return index;
+        }
+    }
+    auto &entries = index->entries;
+    size_t count = symbols.size() / sizeof (Sym);
+    std::vector<Sym> chunk(std::min(count, size_t(4096)));
+    for (size_t base = 0; base < count; base += chunk.size()) {
+        size_t n = std::min(chunk.size(), count - base);
+        symbols.readObj(base * sizeof (Sym), &chunk[0], n);
+        for (size_t i = 0; i < n; ++i) {
+            const auto &candidate = chunk[i];
+            if (candidate.st_shndx >= sectionHeaders.size())
+                continue;
+            if (candidate.st_size != 0 &&
+                  (sectionHeaders[candidate.st_shndx].shdr.sh_flags & SHF_ALLOC) == 0)
+                continue;
+            entries.push_back({ candidate.st_value, candidate.st_size, Word(base + i),
+                  (unsigned char)ELF_ST_TYPE(candidate.st_info), {} });
+        }
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+          [] (const SymbolAddressIndex::Entry &l, const SymbolAddressIndex::Entry &r) {
+             return l.value < r.value; });
+    index->maxEnd.reserve(entries.size());
+    Addr maxEnd = 0;
+    for (const auto &entry : entries) {
+        maxEnd = std::max(maxEnd, entry.value + entry.size);
+        index->maxEnd.push_back(maxEnd);
+    }
+    if (verbose > 1)
+        *debug << "indexed " << entries.size() << " of " << count
+            << " symbols by address in " << *io << "\n";
+    if (path != "")
+        IndexFile::save(path, symbols.size(), {
+              { entries.data(), entries.size() * sizeof entries[0] },
+              { index->maxEnd.data(), index->maxEnd.size() * sizeof index->maxEnd[0] } });
+    return index;
+}
+
+/*
+ * Find the symbol covering addr. As with a linear scan of the table, the
+ * first sized symbol in table order wins; failing that, we report the last
+ * zero-sized symbol at exactly addr.
+ */
+SymbolAddressIndex::Match
+SymbolAddressIndex::find(Addr addr, int type, Word *idx) const
+{
+    auto typeMatches = [type] (const Entry &entry) {
+        return type == STT_NOTYPE || entry.type == type;
+    };
+    size_t end = std::upper_bound(entries.begin(), entries.end(), addr,
+          [] (Addr a, const Entry &entry) { return a < entry.value; }) - entries.begin();
+
+    Match match = Match::NONE;
+    for (size_t i = end; i-- > 0 && maxEnd[i] > addr; ) {
+        const auto &entry = entries[i];
+        if (addr - entry.value < entry.size && typeMatches(entry)
+              && (match == Match::NONE || entry.idx < *idx)) {
+            *idx = entry.idx;
+            match = Match::CONTAINS;
+        }
+    }
+    if (match != Match::NONE)
+        return match;
+
+    for (size_t i = end; i-- > 0 && entries[i].value == addr; ) {
+        const auto &entry = entries[i];
+        if (entry.size == 0 && typeMatches(entry)
+              && (match == Match::NONE || entry.idx > *idx)) {
+            *idx = entry.idx;
+            match = Match::ZEROSIZE;
+        }
+    }
+    return match;
+}
+
 /*
  * Find the symbol that represents a particular address.
  */
@@ -332,36 +455,27 @@ Object::findSymbolByAddress(Addr addr, int type, Sym &sym, string &name)
     /* Try to find symbols in these sections */
     bool haveExactZeroSizeMatch = false;
 
-    auto findSym = [type, addr, this, &sym, &name, &haveExactZeroSizeMatch ](auto &table) {
-        for (const auto &syminfo : table) {
-            auto &candidate = syminfo.symbol;
-            if (candidate.st_shndx >= sectionHeaders.size())
-                continue;
-            if (type != STT_NOTYPE && ELF_ST_TYPE(candidate.st_info) != type)
-                continue;
-            if (candidate.st_value > addr)
-                continue;
-            if (candidate.st_size + candidate.st_value <= addr) {
-                if (candidate.st_size == 0 && candidate.st_value == addr) {
-                    sym = candidate;
-                    name = syminfo.name;
-                    haveExactZeroSizeMatch = true;
-                }
-                continue;
-            }
-            auto &sec = sectionHeaders[candidate.st_shndx];
-            if ((sec.shdr.sh_flags & SHF_ALLOC) == 0)
-                continue;
-            sym = candidate;
-            name = syminfo.name;
-            return true;
+    auto findSym = [type, addr, this, &sym, &name, &haveExactZeroSizeMatch ](auto &table, const char *kind) {
+        if (!table.symbols)
+            return false;
+        std::call_once(table.addressIndexBuilt,
+              [&] { table.addressIndex = buildSymbolIndex(*table.symbols, kind); });
+        Word idx;
+        auto match = table.addressIndex->find(addr, type, &idx);
+        if (match == SymbolAddressIndex::Match::NONE)
+            return false;
+        sym = table.symbols->template readObj<Sym>(idx * sizeof (Sym));
+        name = table.strings->readString(sym.st_name);
+        if (match == SymbolAddressIndex::Match::ZEROSIZE) {
+            haveExactZeroSizeMatch = true;
+            return false;
         }
-        return false;
+        return true;
     };
-    if (findSym(commonSections->debugSymbols)) {
+    if (findSym(commonSections->debugSymbols, "symtab")) {
        return true;
     }
-    if (findSym(commonSections->dynamicSymbols)) {
+    if (findSym(commonSections->dynamicSymbols, "dynsym")) {
        return true;
     }
     // .gnu_debugdata is a separate LZMA-compressed ELF image with just
@@ -473,55 +587,57 @@ Object::~Object() = default;
 Object *
 Object::getDebug() const
 {
+    // Once loaded, the debug object never changes: don't contend for the
+    // cache's lock just to look at it.
+    if (debugReady.load(std::memory_order_acquire))
+        return debugObject.get();
+    std::lock_guard<std::recursive_mutex> guard(imageCache.lock);
     if (!debugLoaded) {
         debugLoaded = true;
-        auto &hdr = getSection(".gnu_debuglink", SHT_PROGBITS);
-        if (!hdr)
-            return 0;
-        auto link = hdr.io->readString(0);
-        auto dir = dirname(stringify(*io));
-        debugObject = imageCache.getDebugImage(dir + "/" + link);
-        if (!debugObject) {
-            for (const auto &note : notes) {
-                if (note.name() == "GNU" && note.type() == GNU_BUILD_ID) {
-                    std::ostringstream dir;
-                    dir << ".build-id/";
-                    size_t i;
-                    auto io = note.data();
-                    std::vector<unsigned char> data(io->size());
-                    io->readObj(0, &data[0], io->size());
-                    dir << std::hex << std::setw(2) << std::setfill('0') << int(data[0]);
-                    dir << "/";
-                    for (i = 1; i < size_t(io->size()); ++i)
-                        dir << std::setw(2) << int(data[i]);
-                    dir << ".debug";
-                    debugObject = imageCache.getDebugImage(dir.str());
-                    break;
-                }
-            }
-        } else {
-            if (verbose >= 2)
-                *debug << "found debug object " << *debugObject->io << " for " << *io << "\n";
-            auto &s = getSection(".dynamic", SHT_NULL);
-            auto &d = debugObject->getSection(".dynamic", SHT_NULL);
-            if (d.shdr.sh_addr != s.shdr.sh_addr) {
-                Elf::Addr diff = s.shdr.sh_addr - d.shdr.sh_addr;
-                IOFlagSave _(std::clog);
-                std::clog << "warning: dynamic section for debug symbols "
-                   << *debugObject->io << " loaded for object "
-                   << *this->io << " at different offset: diff is "
-                   << std::hex << diff << std::endl;
-                // looks like the exe has been prelinked - adjust the debug info too.
-                for (auto &sect : debugObject->sectionHeaders) {
-                    sect.shdr.sh_addr += diff;
-                }
-                for (auto &sectType : debugObject->programHeaders)
-                    for (auto &sect : sectType.second)
-                        sect.p_vaddr += diff;
+        loadDebug();
+        debugReady.store(true, std::memory_order_release);
+    }
+    return debugObject.get();
+}
+
+/*
+ * Find the separate debug object for this one, with the image cache locked.
+ */
+void
+Object::loadDebug() const
+{
+    auto &hdr = getSection(".gnu_debuglink", SHT_PROGBITS);
+    if (!hdr)
+        return;
+    auto link = hdr.io->readString(0);
+    auto dir = dirname(stringify(*io));
+    debugObject = imageCache.getDebugImage(dir + "/" + link);
+    if (!debugObject) {
+        auto buildID = getBuildID();
+        if (buildID != "")
+            debugObject = imageCache.getDebugImage(".build-id/" +
+                  buildID.substr(0, 2) + "/" + buildID.substr(2) + ".debug");
+    } else {
+        if (verbose >= 2)
+            *debug << "found debug object " << *debugObject->io << " for " << *io << "\n";
+        auto &s = getSection(".dynamic", SHT_NULL);
+        auto &d = debugObject->getSection(".dynamic", SHT_NULL);
+        if (d.shdr.sh_addr != s.shdr.sh_addr) {
+            Elf::Addr diff = s.shdr.sh_addr - d.shdr.sh_addr;
+            IOFlagSave _(std::clog);
+            std::clog << "warning: dynamic section for debug symbols "
+               << *debugObject->io << " loaded for object "
+               << *this->io << " at different offset: diff is "
+               << std::hex << diff << std::endl;
+            // looks like the exe has been prelinked - adjust the debug info too.
+            for (auto &sect : debugObject->sectionHeaders) {
+                sect.shdr.sh_addr += diff;
             }
+            for (auto &sectType : debugObject->programHeaders)
+                for (auto &sect : sectType.second)
+                    sect.p_vaddr += diff;
         }
     }
-    return debugObject.get();
 }
 
 template <typename Symtype> bool
@@ -613,14 +729,50 @@ Section::Section(const Reader::csptr &image, off_t off)
 
 Object::sptr
 ImageCache::getImageForName(const string &name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     auto res = getImageIfLoaded(name);
     if (res != nullptr) {
         return res;
     }
+
+    // We may have loaded the same file under another name.
+    struct stat st;
+    bool haveStat = stat(name.c_str(), &st) == 0;
+    auto fileID = haveStat
+        ? std::make_tuple(st.st_dev, st.st_ino, st.st_mtim.tv_sec, st.st_mtim.tv_nsec)
+        : std::make_tuple(dev_t(0), ino_t(0), time_t(0), 0L);
+    if (haveStat) {
+        auto it = filesCache.find(fileID);
+        if (it != filesCache.end()) {
+            elfHits++;
+            if (verbose >= 2)
+                *debug << "using " << *it->second->io << " for " << name << "\n";
+            cache[name] = it->second;
+            return it->second;
+        }
+    }
+
     auto item = make_shared<Object>(*this, std::make_shared<MmapReader>(name));
+
+    // ... or a copy of it. (The size check keeps a separate debug image from
+    // being mistaken for the stripped one that shares its build-id.)
+    auto buildID = item->getBuildID();
+    if (buildID != "") {
+        auto &existing = buildIDCache[std::make_pair(buildID, item->io->size())];
+        if (existing) {
+            if (verbose >= 2)
+                *debug << "using " << *existing->io << " for " << name
+                    << " (same build-id)\n";
+            item = existing;
+        } else {
+            existing = item;
+        }
+    }
     // don't cache negative entries: assign into the cache after we've constructed:
     // a failure to load the image will throw.
     cache[name] = item;
+    if (haveStat)
+        filesCache[fileID] = item;
     return item;
 }
 
@@ -638,6 +790,7 @@ ImageCache::~ImageCache() {
 Object::sptr
 ImageCache::getImageIfLoaded(const string &name)
 {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     elfLookups++;
     auto it = cache.find(name);
     if (it != cache.end()) {
@@ -649,6 +802,7 @@ ImageCache::getImageIfLoaded(const string &name)
 
 Object::sptr
 ImageCache::getDebugImage(const string &name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     // XXX: verify checksum.
     for (const auto &dir : globalDebugDirectories.dirs) {
         auto img = getImageIfLoaded(stringify(dir, "/", name));
@@ -666,15 +820,109 @@ ImageCache::getDebugImage(const string &name) {
     return Object::sptr();
 }
 
+string
+ImageCache::indexPath(const Object &obj, const char *kind) const
+{
+    if (indexDirectory == "")
+        return "";
+    auto buildID = obj.getBuildID();
+    if (buildID == "")
+        return "";
+    return indexDirectory + "/" + buildID + "/" + kind;
+}
+
+namespace {
+const char indexMagic[8] = { 'p', 's', 't', 'k', 'i', 'd', 'x', '1' };
+struct IndexHeader {
+    char magic[sizeof indexMagic];
+    uint64_t source;
+    uint64_t count; // followed by "count" array sizes, then the arrays.
+};
+size_t indexAlign(size_t size) { return (size + 7) & ~size_t(7); }
+}
+
+IndexFile::IndexFile(Reader::csptr io_) : io(std::move(io_)) {}
+
+std::unique_ptr<IndexFile>
+IndexFile::open(const string &path, uint64_t source)
+{
+    if (access(path.c_str(), R_OK) != 0)
+        return nullptr;
+    try {
+        std::unique_ptr<IndexFile> file(new IndexFile(std::make_shared<MmapReader>(path)));
+        auto hdr = file->io->readObj<IndexHeader>(0);
+        if (memcmp(hdr.magic, indexMagic, sizeof indexMagic) != 0 || hdr.source != source)
+            return nullptr;
+        // The file is untrusted: check the sizes in it without overflowing.
+        uint64_t fileSize = file->io->size();
+        if (hdr.count > (fileSize - sizeof hdr) / sizeof (uint64_t))
+            throw (Exception() << "bad array count " << hdr.count);
+        std::vector<uint64_t> sizes(hdr.count);
+        if (hdr.count != 0)
+            file->io->readObj(sizeof hdr, &sizes[0], hdr.count);
+        uint64_t off = indexAlign(sizeof hdr + hdr.count * sizeof (uint64_t));
+        for (auto size : sizes) {
+            if (off > fileSize || size > fileSize - off)
+                throw (Exception() << "truncated");
+            file->arrays.emplace_back(off, size);
+            off += indexAlign(size);
+        }
+        return file;
+    }
+    catch (const std::exception &ex) {
+        if (verbose)
+            *debug << "ignoring index " << path << ": " << ex.what() << "\n";
+        return nullptr;
+    }
+}
+
+void
+IndexFile::save(const string &path, uint64_t source, const Arrays &arrays)
+{
+    // Create the directory for this object, and write to a temporary file
+    // that we rename into place, so readers never see a partial index.
+    auto dir = dirname(path);
+    mkdir(dirname(dir).c_str(), 0777);
+    mkdir(dir.c_str(), 0777);
+    auto tmp = stringify(path, ".", getpid());
+    std::ofstream out(tmp, std::ios::binary);
+    IndexHeader hdr;
+    memcpy(hdr.magic, indexMagic, sizeof indexMagic);
+    hdr.source = source;
+    hdr.count = arrays.size();
+    out.write((const char *)&hdr, sizeof hdr);
+    for (const auto &array : arrays) {
+        uint64_t size = array.second;
+        out.write((const char *)&size, sizeof size);
+    }
+    static const char padding[8] = {};
+    size_t len = sizeof hdr + arrays.size() * sizeof (uint64_t);
+    out.write(padding, indexAlign(len) - len);
+    for (const auto &array : arrays) {
+        out.write((const char *)array.first, array.second);
+        out.write(padding, indexAlign(array.second) - array.second);
+    }
+    out.close();
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+        if (verbose)
+            *debug << "can't save index " << path << ": " << strerror(errno) << "\n";
+        unlink(tmp.c_str());
+    } else if (verbose > 1) {
+        *debug << "saved index " << path << "\n";
+    }
+}
+
 void
 ImageCache::flush(Object::sptr o)
 {
-   for (auto it = cache.begin(); it != cache.end(); ++it) {
-      if (it->second == o) {
-         cache.erase(it);
-         return;
-      }
-   }
+   std::lock_guard<std::recursive_mutex> guard(lock);
+   auto erase = [&o] (auto &map) {
+      for (auto it = map.begin(); it != map.end(); )
+         it = it->second == o ? map.erase(it) : std::next(it);
+   };
+   erase(cache);
+   erase(filesCache);
+   erase(buildIDCache);
 }
 
 VersionedSymbol::VersionedSymbol(const Sym &sym_, const std::string &name_, const Section &versionInfo, size_t idx)
@@ -0,0 +1,156 @@
+#include "libpstack/json.h"
+
+#include <algorithm>
+
+JSONWriter::JSONWriter(std::ostream &os_)
+    : os(os_)
+    , sink(os_.rdbuf())
+{
+    setp(buf, buf + sizeof buf);
+    os.rdbuf(this);
+}
+
+JSONWriter::~JSONWriter()
+{
+    drain();
+    os.rdbuf(sink);
+}
+
+bool
+JSONWriter::drain()
+{
+    std::streamsize count = pptr() - pbase();
+    setp(buf, buf + sizeof buf);
+    return count == 0 || sink->sputn(buf, count) == count;
+}
+
+JSONWriter::int_type
+JSONWriter::overflow(int_type c)
+{
+    if (!drain())
+        return traits_type::eof();
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+        return traits_type::not_eof(c);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+std::streamsize
+JSONWriter::xsputn(const char *data, std::streamsize count)
+{
+    if (count > epptr() - pptr()) {
+        if (!drain())
+            return 0;
+        // Anything that still won't fit goes straight through.
+        if (count > epptr() - pptr())
+            return sink->sputn(data, count);
+    }
+    memcpy(pptr(), data, count);
+    pbump(int(count));
+    return count;
+}
+
+int
+JSONWriter::sync()
+{
+    return drain() ? sink->pubsync() : -1;
+}
+
+namespace JSONOut {
+
+void
+raw(std::ostream &os, const char *data, size_t len)
+{
+    if (os.rdbuf()->sputn(data, len) != std::streamsize(len))
+        os.setstate(std::ios::badbit);
+}
+
+void
+number(std::ostream &os, uintmax_t value)
+{
+    char buf[24];
+    char *p = buf + sizeof buf;
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    raw(os, p, buf + sizeof buf - p);
+}
+
+void
+number(std::ostream &os, intmax_t value)
+{
+    if (value < 0) {
+        raw(os, "-");
+        number(os, -uintmax_t(value));
+    } else {
+        number(os, uintmax_t(value));
+    }
+}
+
+/*
+ * For each byte, 0 if it can appear unescaped in a JSON string, or the
+ * character that follows the backslash in its escape sequence. 'u' means
+ * the byte is written as \u00XX.
+ */
+static const struct EscapeTable {
+    char escape[256];
+    EscapeTable() {
+        for (int c = 0; c < 256; ++c)
+            escape[c] = c < 0x20 ? 'u' : 0;
+        escape['"'] = '"';
+        escape['\\'] = '\\';
+        escape['\b'] = 'b';
+        escape['\f'] = 'f';
+        escape['\n'] = 'n';
+        escape['\r'] = 'r';
+        escape['\t'] = 't';
+    }
+} escapes;
+
+static const char hexDigits[] = "0123456789abcdef";
+
+void
+string(std::ostream &os, const char *data, size_t len)
+{
+    raw(os, "\"");
+    const char *run = data;
+    for (const char *p = data, *end = data + len; p != end; ++p) {
+        char escape = escapes.escape[(unsigned char)*p];
+        if (escape == 0)
+            continue;
+        raw(os, run, p - run);
+        run = p + 1;
+        if (escape == 'u') {
+            char seq[] = { '\\', 'u', '0', '0',
+                hexDigits[(unsigned char)*p >> 4], hexDigits[*p & 0xf] };
+            raw(os, seq, sizeof seq);
+        } else {
+            char seq[] = { '\\', escape };
+            raw(os, seq, sizeof seq);
+        }
+    }
+    raw(os, run, data + len - run);
+    raw(os, "\"");
+}
+
+void
+hexString(std::ostream &os, const unsigned char *data, size_t len)
+{
+    raw(os, "\"");
+    char buf[64];
+    while (len != 0) {
+        size_t chunk = std::min(len, sizeof buf / 2);
+        for (size_t i = 0; i < chunk; ++i) {
+            buf[i * 2] = hexDigits[data[i] >> 4];
+            buf[i * 2 + 1] = hexDigits[data[i] & 0xf];
+        }
+        raw(os, buf, chunk * 2);
+        data += chunk;
+        len -= chunk;
+    }
+    raw(os, "\"");
+}
+
+}
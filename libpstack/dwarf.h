@@ -6,12 +6,17 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stack>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <iterator>
 #include <cassert>
+#include <array>
+#include <bitset>
+#include <functional>
+#include <initializer_list>
 
 namespace Dwarf {
 
@@ -19,6 +24,7 @@ enum HasChildren { DW_CHILDREN_yes = 1, DW_CHILDREN_no = 0 };
 
 class Attribute;
 class DIE;
+class DIEArena;
 class DIEIter;
 class DWARFReader;
 class ExpressionStack;
@@ -89,18 +95,30 @@ enum LineEOpcode {
 #undef DWARF_LINE_E
 
 struct FormEntry {
+    AttrName name;
     Form form;
     intmax_t value;
-    FormEntry(Form f, intmax_t v) : form(f), value(v) {}
+    FormEntry(AttrName n, Form f, intmax_t v) : name(n), form(f), value(v) {}
 };
 
 struct Abbreviation {
     Tag tag;
     bool hasChildren;
-    std::vector<FormEntry> forms;
-    using AttrNameMap = std::unordered_map<AttrName, size_t>;
+    std::vector<FormEntry> forms; // in the order the DIE holds them.
     int nextSibIdx;
-    AttrNameMap attrName2Idx;
+    // The index into forms of each attribute, by name. Standard names are
+    // small, so those index a table directly: the rest (vendor extensions)
+    // are kept in a vector sorted by name.
+    static const size_t DIRECT = 128;
+    static const uint16_t NONE = 0xffff;
+    std::array<uint16_t, DIRECT> direct;
+    std::vector<std::pair<AttrName, uint16_t>> extended;
+    const FormEntry *find(AttrName name) const {
+        if (size_t(name) < DIRECT)
+            return direct[name] == NONE ? nullptr : &forms[direct[name]];
+        return findExtended(name);
+    }
+    const FormEntry *findExtended(AttrName) const;
     Abbreviation(DWARFReader &);
     Abbreviation() {}
 };
@@ -152,13 +170,13 @@ public:
     using key_type = AttrName;
     struct const_iterator {
         const DIE &die;
-        Abbreviation::AttrNameMap::const_iterator rawIter;
+        std::vector<FormEntry>::const_iterator rawIter;
         std::pair<AttrName, Attribute> operator *() const;
         const_iterator &operator++() {
             ++rawIter;
             return *this;
         }
-        const_iterator(const DIE &die_, Abbreviation::AttrNameMap::const_iterator rawIter_) : 
+        const_iterator(const DIE &die_, std::vector<FormEntry>::const_iterator rawIter_) :
             die(die_), rawIter(rawIter_) {}
         bool operator == (const const_iterator &rhs) const {
             return rawIter == rhs.rawIter;
@@ -250,6 +268,10 @@ public:
     FileEntry(DWARFReader &r, LineInfo *info);
 };
 
+/*
+ * The state machine that generates a line number matrix. Each row of the
+ * matrix is a snapshot of this state, stored in LineInfo::Matrix.
+ */
 class LineState {
     LineState() = delete;
 public:
@@ -266,8 +288,30 @@ public:
     LineState(LineInfo *);
 };
 
+enum LineFlags {
+    LINE_IS_STMT = 1,
+    LINE_BASIC_BLOCK = 2,
+    LINE_END_SEQUENCE = 4,
+    LINE_PROLOGUE_END = 8,
+    LINE_EPILOGUE_BEGIN = 16,
+};
+
 class LineInfo {
     LineInfo(const LineInfo &) = delete;
+    /*
+     * A run of rows with ascending addresses, normally a whole sequence.
+     * Rows first to last - 1 cover [start, end), where end is the address
+     * of the last row.
+     */
+    struct Run {
+        Elf::Addr start;
+        Elf::Addr end;
+        uint32_t first;
+        uint32_t last;
+    };
+    std::vector<Run> runs; // sorted by start address.
+    std::vector<Elf::Addr> maxEnd; // maxEnd[i] is the highest end in runs[0..i]
+    void index();
 public:
     LineInfo() {}
     bool default_is_stmt;
@@ -275,25 +319,49 @@ public:
     std::vector<int> opcode_lengths;
     std::vector<std::string> directories;
     std::vector<FileEntry> files;
-    std::vector<LineState> matrix;
+
+    // The line number matrix, with a vector for each column.
+    struct Matrix {
+        std::vector<Elf::Addr> addr;
+        std::vector<uint32_t> file; // index into files.
+        std::vector<uint32_t> line;
+        std::vector<uint32_t> column;
+        std::vector<uint8_t> flags; // LineFlags
+        size_t size() const { return addr.size(); }
+        void add(const LineState &, const LineInfo &);
+    } matrix;
+    static const size_t NOROW = size_t(-1);
+    // The row whose address range includes addr, or NOROW. If rows overlap,
+    // the first in the matrix wins.
+    size_t findRow(Elf::Addr addr) const;
+    const FileEntry &fileAt(size_t row) const;
     void build(DWARFReader &, const Unit *);
+    size_t footprint() const; // approximate heap memory used, in bytes.
 };
 
 
 class Unit : public std::enable_shared_from_this<Unit> {
     Unit() = delete;
     Unit(const Unit &) = delete;
-    std::unique_ptr<LineInfo> lines;
+    std::shared_ptr<const LineInfo> lines; // may be shared with Info's index.
+    size_t lineBytes = 0; // footprint of lines, if we built them.
     std::unordered_map<size_t, Abbreviation> abbreviations;
+    size_t abbreviationBytes;
     off_t topDIEOffset;
-    using AllEntries = std::unordered_map<off_t, std::shared_ptr<RawDIE>>;
-    AllEntries allEntries;
-    std::shared_ptr<RawDIE> decodeEntry(const DIE &parent, off_t offset);
+    // The RawDIEs decoded so far, and the values they hold. DIEs share
+    // ownership of the arena, so it outlives a purge while any are in use.
+    std::shared_ptr<DIEArena> arena;
+    RawDIE *decodeEntry(const DIE &parent, off_t offset);
     UnitType unitType;
+    friend class RawDIE;
+    friend class Info;
 public:
-    void purge(); // Remove all RawDIEs from allEntries, potentially freeing memory.
+    void purge(); // Drop the arena of RawDIEs, freeing it once no DIE refers to it.
     bool isRoot(const DIE &die) { return die.getOffset() == topDIEOffset; }
-    size_t entryCount() const { return allEntries.size(); }
+    size_t entryCount() const;
+    // Approximate memory used by the unit's abbreviations, decoded DIEs and
+    // line table, in bytes.
+    size_t footprint() const;
     typedef std::shared_ptr<Unit> sptr;
     typedef std::shared_ptr<const Unit> csptr;
     const Abbreviation *findAbbreviation(size_t) const;
@@ -351,13 +419,38 @@ struct Units {
     Units(const std::shared_ptr<const Info> &info_) : info(info_) {}
 };
 
+/*
+ * The units of an Info, by offset. Recently used units are kept in an LRU
+ * list, threaded through the map's entries, while their footprint is within
+ * "budget" bytes. Units grow as their DIEs and lines are decoded, so the most
+ * recently used unit is measured again on each lookup. Evicted units keep
+ * their entry, so we still know where each unit starts.
+ */
 struct UnitsCache {
-    std::map<off_t, Unit::sptr> byOffset;
-    std::list<Unit::sptr> LRU;
+    static const size_t DEFAULT_BUDGET = 256 * 1024 * 1024;
+    struct Entry {
+        Unit::sptr unit; // null if the unit has been evicted.
+        size_t bytes = 0; // the unit's footprint when last measured.
+        Entry *newer = nullptr;
+        Entry *older = nullptr;
+    };
+    std::mutex lock;
+    std::map<off_t, Entry> byOffset;
+    size_t budget = DEFAULT_BUDGET;
+    size_t bytes = 0; // total footprint of the cached units.
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
     Unit::sptr get(const Info *, off_t);
     Unit::sptr unitForDIE(const Info *, off_t offset);
+private:
+    Entry *newest = nullptr;
+    Entry *oldest = nullptr;
+    void unlink(Entry &);
+    void measure(Entry &);
 };
 
+struct CallFrameTable;
 struct FDE {
     uintmax_t iloc;
     uintmax_t irange;
@@ -365,7 +458,8 @@ struct FDE {
     Elf::Off end;
     Elf::Off cieOff;
     std::vector<unsigned char> augmentation;
-    FDE(CFI *, DWARFReader &, Elf::Off cieOff_, Elf::Off endOff_);
+    mutable std::shared_ptr<const CallFrameTable> table; // see CFI::callFrameTable
+    FDE(const CFI *, DWARFReader &, Elf::Off cieOff_, Elf::Off endOff_);
 };
 
 enum RegisterType {
@@ -390,14 +484,74 @@ struct RegisterUnwind {
     } u;
 };
 
+/*
+ * Sets of per-register values are arrays indexed by DWARF register number,
+ * sized for the registers in archreg.h, with a bitmap of the valid entries.
+ */
+constexpr int
+highestRegister(std::initializer_list<int> regnos)
+{
+    int highest = -1;
+    for (auto regno : regnos)
+        highest = regno > highest ? regno : highest;
+    return highest;
+}
+
+#pragma push_macro("REGMAP")
+#undef REGMAP
+#define REGMAP(number, field) number,
+const size_t MAXREG = highestRegister({
+#include "libpstack/dwarf/archreg.h"
+}) + 1;
+#pragma pop_macro("REGMAP")
+
+template <typename T> class RegisterSet {
+    std::array<T, MAXREG> values;
+    std::bitset<MAXREG> valid;
+    T discard; // absorbs writes to registers we don't track.
+public:
+    RegisterSet() : values{}, discard{} {}
+    bool contains(unsigned regno) const { return regno < MAXREG && valid[regno]; }
+    const T *find(unsigned regno) const { return contains(regno) ? &values[regno] : nullptr; }
+    T &operator[](unsigned regno) {
+        if (regno >= MAXREG)
+            return discard;
+        valid[regno] = true;
+        return values[regno];
+    }
+    size_t size() const { return valid.count(); }
+};
+
 struct CallFrame {
-    std::map<int, RegisterUnwind> registers;
+    RegisterSet<RegisterUnwind> registers;
     int cfaReg;
     RegisterUnwind cfaValue;
     CallFrame();
     // default copy constructor is valid.
 };
 
+/*
+ * The result of running an FDE's CFA program: a row of unwind rules for each
+ * range of addresses the program distinguishes. Row i applies from start[i]
+ * up to start[i + 1], the last row up to "end". The register rules for each
+ * row are a run of entries in "rules", in register order.
+ */
+struct CallFrameRow {
+    int cfaReg;
+    RegisterUnwind cfaValue;
+    uint32_t firstRule;
+    uint32_t ruleCount;
+};
+
+struct CallFrameTable {
+    std::vector<Elf::Addr> start;
+    std::vector<CallFrameRow> rows;
+    std::vector<std::pair<int, RegisterUnwind>> rules;
+    Elf::Addr end = 0;
+    void add(Elf::Addr from, const CallFrame &);
+    const CallFrameRow *find(Elf::Addr) const; // nullptr if no row covers the address.
+};
+
 struct CIE {
     const CFI *frameInfo;
     uint8_t version;
@@ -415,7 +569,32 @@ struct CIE {
     std::string augmentation;
     CIE(const CFI *, DWARFReader &, Elf::Off);
     CIE() {}
-    CallFrame execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const;
+    CallFrameTable compile(const FDE &) const;
+private:
+    // Run the CFA instructions in "r", starting at "addr", updating "frame".
+    // Before each advance in location, "row" is called with the current
+    // location, the one being advanced to, and the rules that apply between.
+    void execInsns(DWARFReader &r, uintmax_t addr, const CallFrame &dframe, CallFrame &frame,
+          const std::function<void(uintmax_t, uintmax_t, const CallFrame &)> &row) const;
+};
+
+/*
+ * Address-sorted index of the FDEs in a CFI section. Each column lives in its
+ * own array, so binary searching the start addresses stays cache-friendly
+ * even for libraries with hundreds of thousands of FDEs. FDEs may overlap
+ * (hand-written assembly can nest them): maxEnd lets a lookup walk back from
+ * the binary search to an enclosing FDE, and stop once none can cover addr.
+ */
+struct FDEIndex {
+    std::vector<Elf::Addr> iloc;
+    std::vector<Elf::Addr> irange;
+    std::vector<Elf::Off> offset; // offset of the FDE in the CFI section.
+    std::vector<Elf::Addr> maxEnd; // maxEnd[i] is the highest end in [0..i].
+    void add(Elf::Addr loc, Elf::Addr range, Elf::Off off);
+    void sort();
+    void index(); // compute maxEnd once iloc and irange are sorted.
+    Elf::Off find(Elf::Addr) const; // returns Elf::Off(-1) if no FDE covers addr.
+    size_t size() const { return iloc.size(); }
 };
 
 /*
@@ -426,19 +605,125 @@ struct CFI {
     Elf::Addr sectionAddr; // virtual address of this section  (may need to be offset by load address)
     Reader::csptr io;
     FIType type;
-    std::map<Elf::Addr, CIE> cies;
-    std::list<FDE> fdeList;
-    CFI(Info *, Elf::Addr addr, Reader::csptr io, FIType);
+    // CIEs and FDEs, keyed by offset in the section. When indexed from
+    // .eh_frame_hdr, these are decoded on demand.
+    mutable std::map<Elf::Addr, CIE> cies;
+    mutable std::map<Elf::Off, FDE> fdes;
+    FDEIndex fdeIndex;
+    bool lazy; // fdeIndex came from .eh_frame_hdr; not every FDE is decoded.
+    mutable std::recursive_mutex lock; // guards lazy decoding into cies and fdes.
+    // "indexPath", if set, is where the FDE index is saved for reuse.
+    CFI(Info *, Elf::Addr addr, Reader::csptr io, FIType,
+          Reader::csptr hdr = nullptr, Elf::Addr hdrAddr = 0,
+          const std::string &indexPath = "");
     CFI() = delete;
     CFI(const CFI &) = delete;
-    Elf::Addr decodeCIEFDEHdr(DWARFReader &, FIType, Elf::Off *cieOff); // cieOFF set to -1 if this is CIE, set to offset of associated CIE for an FDE
+    Elf::Addr decodeCIEFDEHdr(DWARFReader &, FIType, Elf::Off *cieOff) const; // cieOFF set to -1 if this is CIE, set to offset of associated CIE for an FDE
     const FDE *findFDE(Elf::Addr) const;
-    bool isCIE(Elf::Addr);
+    const CIE &findCIE(Elf::Off) const;
+    const CallFrameTable &callFrameTable(const FDE &) const; // compiled on first use.
+    void decodeAll() const;
+    bool isCIE(Elf::Addr) const;
     intmax_t decodeAddress(DWARFReader &, int encoding) const;
+private:
+    const FDE &fdeAtOffset(Elf::Off) const;
+    bool readHeaderTable(DWARFReader &hdr, Elf::Addr hdrAddr);
+    bool loadIndex(const std::string &path);
 };
 
-struct ARanges {
-    std::map<Elf::Addr, std::pair<Elf::Addr, off_t>> ranges;
+/*
+ * Maps addresses to the offsets of the units whose code covers them. The
+ * ranges are held flat, sorted by start address, so a lookup is a binary
+ * search. Ranges may overlap: maxEnd lets a lookup stop walking back once no
+ * earlier range can reach the address.
+ */
+class ARanges {
+public:
+    struct Range {
+        Elf::Addr start;
+        Elf::Addr end;
+        off_t unit;
+    };
+    void add(Elf::Addr start, Elf::Addr end, off_t unit);
+    void index(); // call after adding ranges, before find().
+    off_t find(Elf::Addr) const; // -1 if no unit covers the address.
+    const std::vector<Range> &all() const { return ranges; }
+private:
+    std::vector<Range> ranges;
+    std::vector<Elf::Addr> maxEnd; // maxEnd[i] is the highest end in ranges[0..i].
+};
+
+// Attributes of entries in a .debug_names index. From DWARFv5 section 6.1.1.4.
+enum NameIndexAttr {
+    DW_IDX_compile_unit = 1,
+    DW_IDX_type_unit = 2,
+    DW_IDX_die_offset = 3,
+    DW_IDX_parent = 4,
+    DW_IDX_type_hash = 5,
+};
+
+/*
+ * A DWARF 5 .debug_names section: a hash table from names to the DIEs that
+ * carry them. Names are unqualified, as in their DW_AT_name. The section may
+ * hold several name tables (e.g., one per unit, if the linker did not merge
+ * them): we probe each.
+ */
+class DebugNames {
+public:
+    struct Match {
+        off_t die; // .debug_info offset of the DIE.
+        // If "scoped", "scopes" has the DIEs enclosing it, innermost first,
+        // from the entries' DW_IDX_parent. Otherwise, the index doesn't say.
+        bool scoped;
+        std::vector<off_t> scopes;
+    };
+    DebugNames(Reader::csptr io, Reader::csptr strings);
+    // Append the DIEs indexed under "name".
+    void find(const std::string &name, std::vector<Match> &) const;
+private:
+    struct Abbrev {
+        Tag tag;
+        std::vector<std::pair<unsigned, Form>> attrs; // DW_IDX_* and form.
+    };
+    struct Entry {
+        off_t die = -1; // .debug_info offset of the DIE, if the entry has one.
+        bool haveParent = false; // the entry has a DW_IDX_parent.
+        // The parent's entry, relative to the table's entries, if it's indexed.
+        uintmax_t parent = std::numeric_limits<uintmax_t>::max();
+    };
+    struct Table {
+        std::vector<off_t> units; // compile units, then local type units.
+        size_t compileUnits;
+        uint32_t bucketCount;
+        uint32_t nameCount;
+        unsigned offsetSize;
+        Elf::Off buckets, hashes, stringOffsets, entryOffsets, entries;
+        std::unordered_map<uintmax_t, Abbrev> abbrevs;
+    };
+    Reader::csptr io;
+    Reader::csptr strings;
+    std::vector<Table> tables;
+    bool readEntry(const Table &, DWARFReader &, Entry &) const;
+    void readEntries(const Table &, DWARFReader &, std::vector<Match> &) const;
+};
+
+/*
+ * A .gdb_index section, as written by gdb-add-index, gold and lld. Its hash
+ * table maps qualified names to the units that define them, so a lookup
+ * gives units to search rather than DIEs.
+ */
+class GdbIndex {
+public:
+    explicit GdbIndex(Reader::csptr io);
+    // Append the .debug_info offsets of the units that define "name".
+    void find(const std::string &name, std::vector<off_t> &) const;
+private:
+    Reader::csptr io;
+    uint32_t version;
+    std::vector<off_t> units;
+    Elf::Off symbols;
+    uint32_t slots; // a power of two.
+    Elf::Off constants;
 };
 
 class ImageCache;
@@ -453,7 +738,6 @@ public:
     typedef std::shared_ptr<Info> sptr;
     typedef std::shared_ptr<const Info> csptr;
     Reader::csptr io; // XXX: io is public because "block" Attributes need to read from it.
-    std::map<Elf::Addr, CallFrame> callFrameForAddr;
     Elf::Object::sptr elf;
     std::unique_ptr<CFI> debugFrame;
     std::unique_ptr<CFI> ehFrame;
@@ -472,9 +756,25 @@ public:
     Unit::sptr lookupUnit(Elf::Addr addr) const;
     std::vector<std::pair<std::string, int>> sourceFromAddr(uintmax_t addr) const;
     mutable Reader::csptr strOffsets;
+    // Index every unit's address ranges and line table up front, with "jobs"
+    // threads. ImageCache::getDwarf does this if its indexJobs is set.
+    void indexUnits(unsigned jobs) const;
+    // The line table built for the unit at "offset" by indexUnits, if any.
+    std::shared_ptr<const LineInfo> indexedLines(off_t offset) const;
+    // The DIEs defining "name", which may be qualified with "::". We use
+    // .debug_names, .gdb_index or .debug_pubnames, whichever we find first.
+    // Units we have to search (all of them, if there is no index) are walked
+    // once, and their definitions remembered by name.
+    std::vector<DIE> findDefinitions(const std::string &name) const;
 
 private:
     void decodeARangeSet(DWARFReader &) const;
+    void loadARanges() const;
+    void addUnitRanges(const Unit::sptr &, ARanges &) const;
+    void loadNameIndexes() const;
+    const std::unordered_multimap<std::string, off_t> &definitionsInUnit(off_t) const;
+    bool loadRanges(const char *kind, uint64_t source) const;
+    void saveRanges(const char *kind, uint64_t source) const;
     std::string getAltImageName() const;
     mutable std::list<PubnameUnit> pubnameUnits;
     // These are mutable so we can lazy-eval them when getters are called, and
@@ -484,12 +784,22 @@ private:
     mutable bool altImageLoaded;
     ImageCache &imageCache;
     mutable Reader::csptr pubnamesh;
+    mutable Reader::csptr debugNamesh;
+    mutable Reader::csptr gdbIndexh;
+    mutable std::unique_ptr<DebugNames> debugNames;
+    mutable std::unique_ptr<GdbIndex> gdbIndex;
+    mutable std::unordered_multimap<std::string, off_t> pubnameIndex;
+    mutable bool nameIndexesLoaded = false;
+    mutable std::map<off_t, std::unordered_multimap<std::string, off_t>> unitDefinitions;
     mutable Reader::csptr arangesh;
     mutable Reader::csptr rangesh;
-    mutable ARanges aranges; // maps starting address to length + unit offset.
+    mutable ARanges aranges; // built on first lookupUnit().
     bool haveLines;
     bool haveARanges;
     mutable bool unitRangesCached = false;
+    mutable std::map<off_t, std::shared_ptr<const LineInfo>> unitLines; // from indexUnits.
+    std::once_flag indexed; // for ImageCache to run indexUnits just once.
+    friend class ImageCache;
 };
 
 /*
@@ -504,6 +814,10 @@ public:
     Info::sptr getDwarf(const std::string &);
     Info::sptr getDwarf(Elf::Object::sptr);
     void flush(Elf::Object::sptr);
+    // Bytes of decoded units each Info keeps. See UnitsCache.
+    size_t unitCacheBudget = UnitsCache::DEFAULT_BUDGET;
+    // If set, getDwarf indexes each Info's units with this many threads.
+    unsigned indexJobs = 0;
     ImageCache();
     ~ImageCache();
 };
@@ -547,7 +861,28 @@ enum CFAInstruction {
 class DWARFReader {
     Elf::Off off;
     Elf::Off end;
+    // If the underlying reader can give us its content in place, we decode
+    // directly from "data", and only go through "io" for anything else. We
+    // ask for the view on the first read rather than on construction, as
+    // many readers are made and never used.
+    const unsigned char *data;
+    Elf::Off dataLen;
+    bool viewed;
+    void loadView() {
+        viewed = true;
+        data = (const unsigned char *)io->view(0, io->size());
+        dataLen = data ? io->size() : 0;
+    }
     uintmax_t getuleb128shift(int &shift, bool &msb);
+    void getBytes(unsigned char *q, size_t len) {
+        if (!viewed)
+            loadView();
+        if (off + len <= dataLen)
+            memcpy(q, data + off, len);
+        else
+            io->readObj(off, q, len);
+        off += len;
+    }
 public:
     ::Reader::csptr io;
     unsigned addrLen;
@@ -555,33 +890,30 @@ public:
     DWARFReader(Reader::csptr io_, Elf::Off off_ = 0, size_t end_ = std::numeric_limits<size_t>::max())
         : off(off_)
         , end(end_ == std::numeric_limits<size_t>::max() ? io_->size() : end_)
+        , data(nullptr)
+        , dataLen(0)
+        , viewed(false)
         , io(std::move(io_))
         , addrLen(ELF_BITS / 8) {
     }
 
     uint32_t getu32() {
         unsigned char q[4];
-        io->readObj(off, q, 4);
-        off += sizeof q;
+        getBytes(q, 4);
         return q[0] | q[1] << 8 | q[2] << 16 | uint32_t(q[3] << 24);
     }
     uint16_t getu16() {
         unsigned char q[2];
-        io->readObj(off, q, 2);
-        off += sizeof q;
+        getBytes(q, 2);
         return q[0] | q[1] << 8;
     }
     uint8_t getu8() {
         unsigned char q;
-        io->readObj(off, &q, 1);
-        off++;
+        getBytes(&q, 1);
         return q;
     }
     int8_t gets8() {
-        int8_t q;
-        io->readObj(off, &q, 1);
-        off += 1;
-        return q;
+        return int8_t(getu8());
     }
     uintmax_t getuint(int len) {
         uintmax_t rc = 0;
@@ -589,8 +921,7 @@ public:
         uint8_t bytes[16];
         if (len > 16)
             throw Exception() << "can't deal with ints of size " << len;
-        io->readObj(off, bytes, len);
-        off += len;
+        getBytes(bytes, len);
         uint8_t *p = bytes + len;
         for (i = 1; i <= len; i++)
             rc = rc << 8 | p[-i];
@@ -602,8 +933,7 @@ public:
         uint8_t bytes[16];
         if (len > 16 || len < 1)
             throw Exception() << "can't deal with ints of size " << len;
-        io->readObj(off, bytes, len);
-        off += len;
+        getBytes(bytes, len);
         uint8_t *p = bytes + len;
         rc = (p[-1] & 0x80) ? -1 : 0;
         for (i = 1; i <= len; i++)
@@ -627,6 +957,16 @@ public:
     }
 
     std::string getstring() {
+        if (!viewed)
+            loadView();
+        if (off < dataLen) {
+            auto start = (const char *)data + off;
+            auto nul = (const char *)memchr(start, 0, dataLen - off);
+            if (nul != nullptr) {
+                off += nul - start + 1;
+                return std::string(start, nul);
+            }
+        }
         std::string s = io->readString(off);
         off += s.size() + 1;
         return s;
@@ -649,6 +989,14 @@ std::string typeName(const DIE &);
 DIE
 findEntryForAddr(Elf::Addr address, Tag, const DIE &start);
 
+/*
+ * Find the source file and line of each of "count" addresses in "unit",
+ * loading its line table once. The location of addrs[i] is appended to
+ * sources[i].
+ */
+void sourcesInUnit(const Unit::sptr &unit, const Elf::Addr *addrs, size_t count,
+      std::vector<std::pair<std::string, int>> *sources);
+
 
 inline
 UnitIterator UnitIterator::operator ++() {
@@ -693,6 +1041,7 @@ enum ExpressionOp {
 #define DW_EH_PE_datarel        0x30
 #define DW_EH_PE_funcrel        0x40
 #define DW_EH_PE_aligned        0x50
+#define DW_EH_PE_omit   0xff
 }
 std::ostream &operator << (std::ostream &os, const JSON<Dwarf::Info> &);
 std::ostream &operator << (std::ostream &os, const JSON<Dwarf::UnitType> &);
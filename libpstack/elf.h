@@ -41,8 +41,10 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <atomic>
 #include <memory>
 #include <limits>
+#include <mutex>
 
 #include "libpstack/util.h"
 #include "libpstack/json.h"
@@ -224,6 +226,25 @@ struct SymbolIterator {
     SymbolType operator *();
 };
 
+/*
+ * Address-sorted index of a symbol table, for mapping addresses to symbols.
+ * Only what's needed to pick a symbol is kept here - the symbol itself and
+ * its name are read from the table for the final match.
+ */
+struct SymbolAddressIndex {
+    struct Entry {
+        Addr value;
+        Addr size;
+        Word idx; // index of the symbol in its table.
+        unsigned char type;
+        unsigned char pad[3]; // always zero, so saved indexes have no stray bytes.
+    };
+    std::vector<Entry> entries; // sorted by value.
+    std::vector<Addr> maxEnd; // maxEnd[i] is the highest end address in entries[0..i]
+    enum class Match { NONE, ZEROSIZE, CONTAINS };
+    Match find(Addr addr, int type, Word *idx) const;
+};
+
 /*
  * A symbol section represents a symbol table - this requires two sections, the
  * set of Sym objects, and the section that contains the strings to name
@@ -236,6 +257,8 @@ struct SymbolSection {
     Reader::csptr strings;
     SymbolIterator<SymbolType> begin() const { return SymbolIterator<SymbolType>(this, 0); }
     SymbolIterator<SymbolType> end() const { return SymbolIterator<SymbolType>(this, symbols ? symbols->size() / sizeof(Sym) : 0); }
+    mutable std::unique_ptr<SymbolAddressIndex> addressIndex; // built on first lookup by address.
+    mutable std::once_flag addressIndexBuilt; // threads symbolizing together build it once.
     SymbolSection(Object *elf_, Reader::csptr symbols_, Reader::csptr strings_)
        : elf(elf_), symbols(symbols_), strings(strings_)
     {}
@@ -295,6 +318,7 @@ public:
 
     // Misc operations
     std::string getInterpreter() const;
+    std::string getBuildID() const; // hex string from the GNU build-id note, or empty.
     const Ehdr &getHeader() const { return elfHeader; }
     const Phdr *getSegmentForAddress(Off) const;
     Notes notes;
@@ -315,10 +339,13 @@ private:
     std::map<Word, ProgramHeaders> programHeaders;
 
     mutable bool debugLoaded; // We've at least attempted to load debugObject: don't try again
+    mutable std::atomic<bool> debugReady; // debugObject is loaded: read it without the lock.
+    void loadDebug() const;
     mutable Object::sptr debugObject; // debug object as per .gnu_debuglink/other.
 
     std::unique_ptr<SymHash> hash; // Symbol hash table.
     std::unique_ptr<GnuHash> gnu_hash; // Enhanced GNU symbol hash table.
+    std::unique_ptr<SymbolAddressIndex> buildSymbolIndex(const Reader &symbols, const char *kind) const;
     Object *getDebug() const; // Gets linked debug object. Note that getSection indirects through this.
     friend std::ostream &::operator<< (std::ostream &, const JSON<Elf::Object> &);
     struct CachedSymbol {
@@ -327,7 +354,7 @@ private:
         CachedSymbol() : disposition { SYM_NEW } {}
     };
     std::map<std::string, CachedSymbol> cachedSymbols;
-    mutable const Phdr *lastSegmentForAddress; // cache of last segment returned for a specific address.
+    mutable std::atomic<const Phdr *> lastSegmentForAddress; // cache of last segment returned for a specific address.
 };
 // These are the architecture specific types representing the NT_PRSTATUS registers.
 #if defined(__PPC)
@@ -444,21 +471,67 @@ public:
 extern GlobalDebugDirectories globalDebugDirectories;
 
 /*
- * A cache of named files to ELF objects. Note no deduping is done for symbolic
- * links, hard links, or canonicalization of filenames. (XXX: do this with stat
- * & st_ino + st_dev)
+ * Indexes built from an object's sections (the sorted FDE, symbol, and
+ * address range tables) can be saved in a directory, keyed by the object's
+ * build-id, and mapped in by later runs rather than being rebuilt. An index
+ * file is a set of arrays of plain data, tagged with a value derived from the
+ * section it was built from (usually its size), so a stale file is ignored.
+ */
+class IndexFile {
+    Reader::csptr io;
+    std::vector<std::pair<off_t, size_t>> arrays; // offset and size in bytes.
+    IndexFile(Reader::csptr);
+public:
+    typedef std::vector<std::pair<const void *, size_t>> Arrays;
+    // returns null if there is no usable index at "path" built from "source".
+    static std::unique_ptr<IndexFile> open(const std::string &path, uint64_t source);
+    static void save(const std::string &path, uint64_t source, const Arrays &);
+    size_t count() const { return arrays.size(); }
+    template <typename T> bool get(size_t idx, std::vector<T> &out) const;
+};
+
+template <typename T> bool
+IndexFile::get(size_t idx, std::vector<T> &out) const
+{
+    if (idx >= arrays.size() || arrays[idx].second % sizeof (T) != 0)
+        return false;
+    if (arrays[idx].second == 0) {
+        out.clear();
+        return true;
+    }
+    auto data = reinterpret_cast<const T *>(io->view(arrays[idx].first, arrays[idx].second));
+    if (data == nullptr)
+        return false;
+    out.assign(data, data + arrays[idx].second / sizeof (T));
+    return true;
+}
+
+/*
+ * A cache of named files to ELF objects. Names that refer to the same file
+ * (by device, inode, and modification time), or to files with the same
+ * build-id and size, share one object, so everything derived from it is
+ * computed once per run, however many processes use it.
  */
 class ImageCache {
     std::map<std::string, Object::sptr> cache;
+    std::map<std::tuple<dev_t, ino_t, time_t, long>, Object::sptr> filesCache;
+    std::map<std::pair<std::string, off_t>, Object::sptr> buildIDCache;
     int elfHits;
     int elfLookups;
 public:
+    // Guards the cache, and the lazily-loaded state of the images in it.
+    std::recursive_mutex lock;
     ImageCache();
     virtual ~ImageCache();
     virtual void flush(Object::sptr);
     Object::sptr getImageForName(const std::string &name);
     Object::sptr getImageIfLoaded(const std::string &name);
     Object::sptr getDebugImage(const std::string &name);
+
+    // If set, indexes are saved here and reused across runs. See IndexFile.
+    std::string indexDirectory;
+    // Path of the index of type "kind" for "obj", or empty if not possible.
+    std::string indexPath(const Object &obj, const char *kind) const;
 };
 
 } // Elf namespace
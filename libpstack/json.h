@@ -6,8 +6,11 @@
 #include <type_traits>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <typeinfo>
 #include <map>
+#include <string>
+#include <vector>
 
 /*
  * General purpose way of printing out JSON objects.
@@ -28,7 +31,46 @@
  *     return JObject(o).field("foo", myObject.foo).field("bar", myObject.bar());
  *
  * There are wrappers for arrays, and C++ containers to do the right thing.
+ *
+ * The printers for numbers, strings and punctuation below write straight to
+ * the stream's buffer rather than through std::ostream's formatted (and
+ * locale-aware) output. For large documents, install a JSONWriter on the
+ * stream as well, so those writes land in a large private buffer rather than,
+ * say, going through stdio a character at a time for std::cout.
+ */
+
+/*
+ * Replaces the buffer of an ostream with a larger one for its lifetime, and
+ * flushes to the original buffer when full, and when destroyed.
  */
+class JSONWriter : public std::streambuf {
+   std::ostream &os;
+   std::streambuf *sink;
+   char buf[64 * 1024];
+   bool drain();
+protected:
+   int_type overflow(int_type c) override;
+   std::streamsize xsputn(const char *data, std::streamsize count) override;
+   int sync() override;
+public:
+   explicit JSONWriter(std::ostream &os);
+   ~JSONWriter();
+   JSONWriter(const JSONWriter &) = delete;
+   JSONWriter &operator = (const JSONWriter &) = delete;
+};
+
+/*
+ * Unformatted writers for JSON primitives. These bypass the ostream's
+ * formatting flags - JSON numbers are always decimal.
+ */
+namespace JSONOut {
+void raw(std::ostream &os, const char *data, size_t len);
+template <size_t N> void raw(std::ostream &os, const char (&lit)[N]) { raw(os, lit, N - 1); }
+void number(std::ostream &os, uintmax_t value);
+void number(std::ostream &os, intmax_t value);
+void string(std::ostream &os, const char *data, size_t len); // quoted and escaped.
+void hexString(std::ostream &os, const unsigned char *data, size_t len); // quoted.
+}
 
 /*
  * A wrapper for objects so we can serialize them as JSON.
@@ -69,7 +111,13 @@ struct Field {
  */
 template <typename T, typename C>
 typename std::enable_if<std::is_integral<T>::value, std::ostream>::type &
-operator << (std::ostream &os, const JSON<T, C>&json) { return os << json.object; }
+operator << (std::ostream &os, const JSON<T, C>&json) {
+   if (std::is_signed<T>::value)
+      JSONOut::number(os, intmax_t(json.object));
+   else
+      JSONOut::number(os, uintmax_t(json.object));
+   return os;
+}
 
 /*
  * A printer for JSON boolean types: print "true" or "false"
@@ -77,7 +125,13 @@ operator << (std::ostream &os, const JSON<T, C>&json) { return os << json.object
 template <typename C>
 std::ostream &
 operator << (std::ostream &os, const JSON<bool, C> &json)
-   { return os << (json.object ? "true" : "false"); }
+{
+   if (json.object)
+      JSONOut::raw(os, "true");
+   else
+      JSONOut::raw(os, "false");
+   return os;
+}
 
 /*
  * printers for arrays. char[N] is special, we treat that as a string.
@@ -91,11 +145,14 @@ template <typename T, size_t N, typename C>
 std::ostream &
 operator << (std::ostream &os, const JSON<T[N], C> &json)
 {
-    os << "[";
+    JSONOut::raw(os, "[");
     for (size_t i = 0; i < N; ++i) {
-        os << (i ? ",\n" : "") << json.object[i];
+        if (i)
+           JSONOut::raw(os, ",\n");
+        os << ::json(json.object[i], json.context);
     }
-    return os << "]";
+    JSONOut::raw(os, "]");
+    return os;
 }
 
 /*
@@ -105,7 +162,9 @@ template <typename K, typename V, typename C>
 std::ostream &
 operator << (std::ostream &os, const JSON<Field<K,V>, C> &o)
 {
-   return os << json(o.object.k) << ":" << json(o.object.v, o.context);
+   os << json(o.object.k);
+   JSONOut::raw(os, ":");
+   return os << json(o.object.v, o.context);
 }
 
 /*
@@ -126,13 +185,15 @@ constexpr std::true_type is_associative_container(const C *) {
 template <typename Container, typename Context>
 void print_container(std::ostream &os, const Container &container, Context ctx, std::false_type)
 {
-   os << "[ ";
-   const char *sep = "";
+   JSONOut::raw(os, "[ ");
+   bool first = true;
    for (const auto &field : container) {
-      os << sep << json(field, ctx);
-      sep = ",\n";
+      if (!first)
+         JSONOut::raw(os, ",\n");
+      first = false;
+      os << json(field, ctx);
    }
-   os << " ]";
+   JSONOut::raw(os, " ]");
 }
 
 /*
@@ -147,14 +208,16 @@ template <typename Container,
 void
 print_container(std::ostream &os, const Container &container, Context ctx, std::true_type)
 {
-   os << "{";
-   const char *sep = "";
+   JSONOut::raw(os, "{");
+   bool first = true;
    for (const auto &field : container) {
       Field<K,V> jfield(field.first, field.second);
-      os << sep << json(jfield, ctx);
-      sep = ", ";
+      if (!first)
+         JSONOut::raw(os, ", ");
+      first = false;
+      os << json(jfield, ctx);
    }
-   os << "}";
+   JSONOut::raw(os, "}");
 }
 
 /*
@@ -173,13 +236,15 @@ operator << (std::ostream &os, const JSON<Container, Context> &container) {
 template <typename C>
 std::ostream &
 operator << (std::ostream &os, const JSON<std::string, C> &json) {
-   return os << "\"" << json.object << "\"";
+   JSONOut::string(os, json.object.data(), json.object.size());
+   return os;
 }
 
 template <typename C>
 std::ostream &
 operator << (std::ostream &os, const JSON<const char *, C> &json) {
-   return os << "\"" << json.object << "\"";
+   JSONOut::string(os, json.object, strlen(json.object));
+   return os;
 }
 
 /*
@@ -219,18 +284,20 @@ public:
 /* Helper for rendering compound types. */
 class JObject {
    std::ostream &os;
-   const char *sep;
+   bool first;
    public:
-      JObject(std::ostream &os_) : os(os_), sep("") {
-         os << "{ ";
+      JObject(std::ostream &os_) : os(os_), first(true) {
+         JSONOut::raw(os, "{ ");
       }
       ~JObject() {
-         os << " }";
+         JSONOut::raw(os, " }");
       }
       template <typename K, typename V, typename C = char> JObject &field(const K &k, const V&v, const C &c = C()) {
          Field<K,V> field(k, v);
-         os << sep << json(field, c);
-         sep = ", ";
+         if (!first)
+            JSONOut::raw(os, ", ");
+         first = false;
+         os << json(field, c);
          return *this;
       }
       operator std::ostream &() { return os; }
@@ -253,8 +320,23 @@ class JsonNull {};
 template <typename C>
 std::ostream &
 operator << (std::ostream &os, const JSON<JsonNull, C> &) {
-   return os << "null";
+   JSONOut::raw(os, "null");
+   return os;
 }
 
+/*
+ * A block of bytes, printed as a string of hex digits.
+ */
+struct JsonHex {
+   const std::vector<unsigned char> &bytes;
+   explicit JsonHex(const std::vector<unsigned char> &bytes_) : bytes(bytes_) {}
+};
+
+template <typename C>
+std::ostream &
+operator << (std::ostream &os, const JSON<JsonHex, C> &hex) {
+   JSONOut::hexString(os, hex->bytes.data(), hex->bytes.size());
+   return os;
+}
 
 #endif
@@ -17,10 +17,13 @@ class LzmaReader : public Reader {
     size_t pos = 0;
     Reader::csptr upstream;
     mutable std::map<off_t, std::vector<unsigned char>> lzBlocks;
+    mutable std::mutex lock; // guards lzBlocks.
+    const std::vector<unsigned char> &getBlock(off_t offset, size_t *blockOff) const;
 public:
     LzmaReader(Reader::csptr upstream_);
     ~LzmaReader();
     size_t read(off_t, size_t, char *) const override;
+    const char *view(off_t, size_t) const override;
     void describe(std::ostream &) const override;
     off_t size() const override;
     std::string filename() const override { return upstream->filename(); }
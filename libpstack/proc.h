@@ -7,10 +7,12 @@ extern "C" {
 }
 
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <functional>
 #include <bitset>
+#include <type_traits>
 
 #include "libpstack/ps_callback.h"
 #include "libpstack/dwarf.h"
@@ -21,6 +23,7 @@ class Process;
 
 namespace Dwarf {
 struct StackFrame;
+class FrameArena;
 class ExpressionStack : public std::stack<Elf::Addr> {
 public:
     bool isReg;
@@ -63,7 +66,7 @@ struct StackFrame {
     Elf::Addr rawIP() const;
     Elf::Addr scopeIP() const;
     Elf::Addr cfa;
-    std::map<unsigned, cpureg_t> regs;
+    RegisterSet<cpureg_t> regs;
     Elf::Object::sptr elf;
     Elf::Addr elfReloc;
     const Elf::Phdr *phdr;
@@ -89,27 +92,73 @@ struct StackFrame {
     StackFrame &operator = (const StackFrame &) = delete;
     void setReg(unsigned, cpureg_t);
     cpureg_t getReg(unsigned regno) const;
-    Elf::Addr getCFA(const Process &, const CallFrame &) const;
-    StackFrame *unwind(Process &p);
+    Elf::Addr getCFA(const Process &, const CallFrameRow &) const;
+    StackFrame *unwind(Process &p, FrameArena &);
     void setCoreRegs(const Elf::CoreRegisters &);
     void getCoreRegs(Elf::CoreRegisters &) const;
     void getFrameBase(const Process &, intmax_t, ExpressionStack *) const;
 };
+
+/*
+ * Owns the stack frames from a pass over a process's threads, and destroys
+ * them together on reset(). The storage is kept for the next pass, so once
+ * the arena has grown to hold a pass, unwinding allocates no more frames.
+ * Frames may be made from several threads at once.
+ */
+class FrameArena {
+    typedef std::aligned_storage<sizeof (StackFrame), alignof (StackFrame)>::type Slot;
+    static const size_t BLOCKSIZE = 256;
+    std::vector<std::unique_ptr<Slot[]>> blocks;
+    size_t used = 0;
+    std::mutex lock;
+public:
+    FrameArena() = default;
+    FrameArena(const FrameArena &) = delete;
+    ~FrameArena() { reset(); }
+    template <typename... Args> StackFrame *make(Args &&... args);
+    void reset();
+};
+
+template <typename... Args> StackFrame *
+FrameArena::make(Args &&... args)
+{
+    // Count the slot as used only once the frame is built, so reset() never
+    // destroys a frame whose constructor threw. Construction is cheap, so we
+    // do it under the lock rather than reserving the slot first.
+    std::lock_guard<std::mutex> guard(lock);
+    if (used == blocks.size() * BLOCKSIZE)
+        blocks.emplace_back(new Slot[BLOCKSIZE]);
+    auto frame = new (&blocks[used / BLOCKSIZE][used % BLOCKSIZE])
+        StackFrame(std::forward<Args>(args)...);
+    used++;
+    return frame;
+}
 }
 
 struct ThreadStack {
     td_thrinfo_t info;
-    std::vector<Dwarf::StackFrame *> stack;
+    std::vector<Dwarf::StackFrame *> stack; // frames are owned by the arena they were unwound into.
     ThreadStack() {
         memset(&info, 0, sizeof info);
     }
-    ~ThreadStack() {
-        for (auto i = stack.begin(); i != stack.end(); ++i)
-            delete *i;
-    }
-    void unwind(Process &, Elf::CoreRegisters &regs);
+    void unwind(Process &, Elf::CoreRegisters &regs, Dwarf::FrameArena &);
 };
 
+/*
+ * Threads whose stacks have the same sequence of instruction addresses, so
+ * the stack need only be printed once.
+ */
+struct StackGroup {
+    std::vector<const ThreadStack *> threads;
+    const ThreadStack &stack() const { return *threads.front(); }
+};
+// Groups are ordered by number of threads, most first.
+std::vector<StackGroup> groupStacks(const std::list<ThreadStack> &);
+
+// Print the name of the entity described by a DIE, qualified by its
+// enclosing classes and namespaces.
+bool dieName(std::ostream &, const Dwarf::DIE &, bool first = true);
+
 enum PstackOption {
     nosrc,
     doargs,
@@ -172,8 +221,12 @@ public:
     virtual void resumeProcess() = 0;
     virtual void resume(pid_t lwpid) = 0;
     std::ostream &dumpStackText(std::ostream &, const ThreadStack &, const PstackOptions &) const;
+    std::ostream &dumpStackText(std::ostream &, const StackGroup &, const PstackOptions &) const;
     std::ostream &dumpFrameText(std::ostream &, const PrintableFrame &, Dwarf::StackFrame *) const;
     std::ostream &dumpStackJSON(std::ostream &, const ThreadStack &) const;
+    // The function containing the frame's instruction, and any inlined
+    // into it there, outermost first.
+    std::vector<std::string> frameFunctions(Dwarf::StackFrame *) const;
     template <typename T> void listThreads(const T &);
 
 
@@ -208,6 +261,26 @@ public:
     LiveReader(pid_t, const std::string &);
 };
 
+/*
+ * Reads memory from a live process with process_vm_readv, so a batch of
+ * reads can go out in a single system call. If the kernel refuses us that,
+ * we read /proc/<pid>/mem instead.
+ */
+class ProcessVMReader : public Reader {
+    pid_t pid;
+    LiveReader fallback;
+    mutable std::atomic<bool> useFallback;
+    bool unavailable(int err) const;
+    size_t readRest(off_t, size_t, char *, size_t got) const;
+public:
+    ProcessVMReader(pid_t);
+    size_t read(off_t, size_t, char *) const override;
+    void readBatch(ReadRequest *, size_t) const override;
+    void describe(std::ostream &os) const override { fallback.describe(os); }
+    off_t size() const override { return std::numeric_limits<off_t>::max(); }
+    std::string filename() const override { return fallback.filename(); }
+};
+
 // Name of the file /proc/<pid>/name, after symlink dereferencing
 std::string procname(pid_t pid, const std::string &);
 
@@ -0,0 +1,100 @@
+#ifndef libpstack_snapshot_h
+#define libpstack_snapshot_h
+
+#include "libpstack/proc.h"
+
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+
+/*
+ * A compact binary record of the stacks in a process, cheap to produce on
+ * the host being examined, and symbolized later, possibly elsewhere.
+ *
+ * A snapshot stream is an 8-byte magic, followed by any number of records,
+ * each a ULEB128 type, a ULEB128 length, and that many bytes of payload.
+ * Integers in payloads are LEB128-encoded, and strings are a length followed
+ * by their bytes. Unknown record types are skipped. A stream holds any number
+ * of captures, so several passes over several processes can go to one file.
+ *
+ * Each capture starts with a PROCESS record. MODULE records describe the ELF
+ * objects its frames are in, by path, load address and build ID. A module
+ * that might not be found again by those is followed by a SYMBOLS record
+ * holding its function symbols. Then there is a THREAD record per thread,
+ * with the module, module-relative address, and CFA of each frame.
+ */
+namespace Snapshot {
+
+enum RecordType {
+    PROCESS = 1,
+    MODULE = 2,
+    SYMBOLS = 3,
+    THREAD = 4,
+};
+
+enum FrameFlags {
+    SIGNAL_FRAME = 1, // the frame was interrupted by a signal.
+    EXACT_IP = 2, // the address is the current instruction, not a return address.
+};
+
+struct Symbol {
+    Elf::Addr value;
+    Elf::Addr size;
+    std::string name;
+};
+
+struct Module {
+    Elf::Addr loadAddress;
+    std::string path;
+    std::string buildID;
+    std::vector<Symbol> symbols; // sorted by value. Empty unless embedded.
+};
+
+struct Frame {
+    size_t module; // index into Capture::modules, plus one. Zero for none.
+    Elf::Addr address; // relative to the module, if there is one.
+    Elf::Addr cfa;
+    unsigned flags;
+    Elf::Addr pc(const std::vector<Module> &modules) const {
+        return module ? address + modules[module - 1].loadAddress : address;
+    }
+};
+
+struct Thread {
+    lwpid_t lwp;
+    uint64_t tid; // thread_t, if known.
+    std::vector<Frame> frames;
+};
+
+struct Capture {
+    pid_t pid;
+    uint64_t time; // microseconds since the epoch.
+    std::string description;
+    std::vector<Module> modules;
+    std::vector<Thread> threads;
+};
+
+class Writer {
+    std::ostream &os;
+    void record(RecordType, const std::string &payload);
+public:
+    explicit Writer(std::ostream &);
+    void write(const Process &, const std::list<ThreadStack> &);
+};
+
+class Decoder {
+    std::istream &is;
+    std::string pending; // PROCESS record that starts the next capture.
+    bool readRecord(unsigned &type, std::string &payload);
+public:
+    explicit Decoder(std::istream &);
+    bool next(Capture &);
+};
+
+// Print a capture in the same form as a live process's stacks.
+std::ostream &print(std::ostream &, const Capture &, Dwarf::ImageCache &, const PstackOptions &);
+
+}
+
+#endif
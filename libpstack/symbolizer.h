@@ -0,0 +1,62 @@
+#ifndef libpstack_symbolizer_h
+#define libpstack_symbolizer_h
+
+#include "libpstack/dwarf.h"
+
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Dwarf {
+struct StackFrame;
+}
+
+/*
+ * Resolves addresses in ELF objects to functions and source lines, without
+ * needing the process they came from. Addresses are queued with add(), and
+ * resolved together by resolve(), in order of object and address, so each
+ * DWARF unit's DIEs and line table are walked once for all the addresses
+ * that fall in it, and an address seen many times is resolved once.
+ */
+class Symbolizer {
+public:
+    struct Result {
+        std::string dieName; // name of the function from the DWARF, if found.
+        bool haveSym = false; // symbol and symName hold the function's ELF symbol.
+        Elf::Sym symbol {};
+        std::string symName;
+        Elf::Addr functionOffset = std::numeric_limits<Elf::Addr>::max();
+        std::vector<std::pair<std::string, int>> source;
+    };
+
+    Symbolizer(Dwarf::ImageCache &, bool wantSource);
+
+    // Find an object at "path" if it has the given build ID (or any, if
+    // "buildID" is empty), or else the debug image for the build ID.
+    Elf::Object::sptr findObject(const std::string &path, const std::string &buildID);
+
+    // Queue a lookup of an address, relative to the object's load address.
+    void add(const Elf::Object::sptr &, Elf::Addr);
+    // Queue a lookup of the instruction in a stack frame.
+    void add(const Dwarf::StackFrame &);
+
+    void resolve();
+
+    // The result for an address, once resolved, or null.
+    const Result *find(const Elf::Object *, Elf::Addr) const;
+    const Result *find(const Dwarf::StackFrame &) const;
+
+private:
+    struct Entry {
+        bool resolved = false;
+        Result result;
+    };
+    Dwarf::ImageCache &cache;
+    bool wantSource;
+    std::map<const Elf::Object *, Elf::Object::sptr> objects;
+    std::map<std::pair<const Elf::Object *, Elf::Addr>, Entry> entries; // sorted for resolve().
+    void resolveObject(const Elf::Object::sptr &, std::vector<std::pair<Elf::Addr, Result *>> &);
+};
+
+#endif
@@ -6,7 +6,9 @@
 #include <limits>
 #include <vector>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdio.h>
 #include <string>
@@ -122,6 +124,25 @@ public:
     // read a text string at an offset
     virtual std::string readString(off_t offset) const;
 
+    // One of a batch of reads passed to readBatch.
+    struct ReadRequest {
+        off_t off;
+        size_t count;
+        char *ptr;
+        size_t result; // bytes actually read.
+    };
+
+    // Perform a set of reads. Readers that can service many reads at once
+    // override this; by default, each is read in turn. A failed read gives a
+    // short "result" rather than an exception.
+    virtual void readBatch(ReadRequest *requests, size_t count) const;
+
+    // Give direct access to "count" bytes at offset "off", if they are
+    // contiguous in memory already. Returns nullptr if the reader can't do
+    // that, and the caller must use read() instead. The bytes remain valid
+    // for the lifetime of the reader.
+    virtual const char *view(off_t, size_t) const { return nullptr; }
+
     virtual off_t size() const = 0;
     typedef std::shared_ptr<Reader> sptr;
     typedef std::shared_ptr<const Reader> csptr;
@@ -175,47 +196,61 @@ public:
     virtual size_t read(off_t off, size_t count, char *ptr) const override ;
     MmapReader(const std::string &name_);
     ~MmapReader();
-    std::string readString(off_t offset) const override;
+    const char *view(off_t off, size_t count) const override;
     void describe(std::ostream &os) const  override { os << name; }
     std::string filename() const override { return name; }
     off_t size() const override { return len; }
 };
 
 
+/*
+ * Caches fixed-size pages of an upstream reader. Pages are found through a
+ * hash table keyed by page offset, and evicted in least-recently-used order
+ * once "maxPages" are held.
+ */
 class CacheReader : public Reader {
-    struct CacheEnt {
-        std::string value;
-        bool isNew;
-        CacheEnt() : isNew(true) {}
+public:
+    static const size_t DEFAULT_PAGESIZE = 4096;
+    static const size_t DEFAULT_MAXPAGES = 256;
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
     };
+private:
     Reader::csptr upstream;
-    mutable std::unordered_map<off_t, CacheEnt> stringCache;
-    static const size_t PAGESIZE = 256;
-    static const size_t MAXPAGES = 16;
-    class Page {
-        Page(const Page &) = delete;
-    public:
+    mutable std::unordered_map<off_t, std::string> stringCache;
+    struct Page {
         off_t offset;
         size_t len;
-        char data[PAGESIZE];
-        Page() {};
-        void load(const Reader &r, off_t offset_);
+        std::unique_ptr<char[]> data;
     };
-    mutable std::list<Page *> pages;
-    Page *getPage(off_t pageoff) const;
+    typedef std::list<Page> PageList;
+    const size_t pageSize;
+    const size_t maxPages;
+    mutable PageList pages; // most recently used at the front.
+    mutable std::unordered_map<off_t, PageList::iterator> pageIndex;
+    mutable Stats stats;
+    mutable std::mutex lock; // guards all of the above, so threads can share a CacheReader.
+    const Page &getPage(off_t pageoff) const;
+    Page &newPage(off_t pageoff) const;
+    size_t readPages(off_t off, size_t count, char *ptr) const;
 public:
     void flush();
     virtual size_t read(off_t off, size_t count, char *ptr) const override;
+    void readBatch(ReadRequest *requests, size_t count) const override;
     virtual void describe(std::ostream &os) const override {
         // this must be the same as the underlying stream: we sometimes rely on the
         // FileReader's filename
         os << *upstream;
     }
-    CacheReader(Reader::csptr upstream_);
+    CacheReader(Reader::csptr upstream_, size_t pageSize_ = DEFAULT_PAGESIZE,
+          size_t maxPages_ = DEFAULT_MAXPAGES);
     std::string readString(off_t off) const override;
     ~CacheReader();
     off_t size() const override { return upstream->size(); }
     std::string filename() const override { return upstream->filename(); }
+    const Stats &getStats() const { return stats; }
 };
 
 class MemReader : public Reader {
@@ -225,6 +260,7 @@ protected:
     const char *data;
 public:
     virtual size_t read(off_t off, size_t count, char *ptr) const override;
+    const char *view(off_t off, size_t count) const override;
     MemReader(const std::string &, size_t, const char *);
     void describe(std::ostream &) const override;
     off_t size() const override { return len; }
@@ -258,6 +294,11 @@ public:
            count = length - off;
         return upstream->read(off + offset, count, ptr);
     }
+    const char *view(off_t off, size_t count) const override {
+        if (off > length || off_t(count) > length - off)
+            return nullptr;
+        return upstream->view(off + offset, count);
+    }
     OffsetReader(Reader::csptr upstream_, off_t offset_,
           off_t length_ = std::numeric_limits<off_t>::max())
        : upstream(upstream_)
@@ -271,6 +312,28 @@ public:
     std::string filename() const override { return upstream->filename(); }
 };
 
+/*
+ * Holds copies of selected ranges of an upstream reader, taken at some point
+ * in time - e.g., the stacks of a process's threads while it was stopped.
+ * Reads within those ranges are served from the copies. Upstream may have
+ * changed since, so only ranges marked as unchanging with passThrough() are
+ * read from it; anything else reads short.
+ */
+class SnapshotReader : public Reader {
+    Reader::csptr upstream;
+    std::map<off_t, std::vector<char>> ranges; // keyed by start offset.
+    std::map<off_t, off_t> liveRanges; // start to end of pass-through ranges.
+public:
+    SnapshotReader(Reader::csptr upstream_) : upstream(std::move(upstream_)) {}
+    size_t capture(off_t off, size_t count);
+    void passThrough(off_t off, size_t count);
+    size_t read(off_t off, size_t count, char *ptr) const override;
+    const char *view(off_t off, size_t count) const override;
+    void describe(std::ostream &os) const override { os << *upstream; }
+    off_t size() const override { return upstream->size(); }
+    std::string filename() const override { return upstream->filename(); }
+};
+
 std::string linkResolve(std::string name);
 
 template <typename T> T maybe(T val, T dflt) {
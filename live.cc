@@ -3,6 +3,7 @@
 
 #include <sys/ptrace.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <dirent.h>
 #include <err.h>
@@ -10,9 +11,11 @@
 #include <unistd.h>
 #include <wait.h>
 
+#include <algorithm>
 #include <climits>
 #include <iostream>
 #include <utility>
+#include <vector>
 
 std::string
 procname(pid_t pid, const std::string &base)
@@ -23,11 +26,113 @@ procname(pid_t pid, const std::string &base)
 LiveReader::LiveReader(pid_t pid, const std::string &base)
    : FileReader(procname(pid, base)) {}
 
+ProcessVMReader::ProcessVMReader(pid_t pid_)
+   : pid(pid_)
+   , fallback(pid_, "mem")
+   , useFallback(false)
+{
+}
+
+/*
+ * Check if an error from process_vm_readv means we can't use it at all,
+ * rather than that the memory isn't there. Switch to the fallback if so.
+ */
+bool
+ProcessVMReader::unavailable(int err) const
+{
+    if (err != ENOSYS && err != EPERM)
+        return false;
+    if (verbose)
+        *debug << "process_vm_readv unavailable for " << pid << " (" << strerror(err)
+           << "): reading " << fallback << " instead\n";
+    useFallback = true;
+    return true;
+}
+
+/*
+ * Read what process_vm_readv can't through /proc/<pid>/mem: it's slower, but
+ * can see pages process_vm_readv refuses, such as those without read access.
+ */
+size_t
+ProcessVMReader::readRest(off_t off, size_t count, char *ptr, size_t got) const
+{
+    if (got == count)
+        return got;
+    try {
+        return got + fallback.read(off + got, count - got, ptr + got);
+    }
+    catch (const std::exception &) {
+        if (got == 0)
+            throw;
+        return got; // keep what we have, as a short read.
+    }
+}
+
+size_t
+ProcessVMReader::read(off_t off, size_t count, char *ptr) const
+{
+    if (!useFallback) {
+        iovec local { ptr, count };
+        iovec remote { (void *)off, count };
+        auto rc = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (rc != -1)
+            return readRest(off, count, ptr, rc);
+        if (!unavailable(errno))
+            return readRest(off, count, ptr, 0);
+    }
+    return fallback.read(off, count, ptr);
+}
+
+void
+ProcessVMReader::readBatch(ReadRequest *requests, size_t count) const
+{
+    std::vector<iovec> local;
+    std::vector<iovec> remote;
+    while (count != 0 && !useFallback) {
+        size_t batch = std::min(count, size_t(IOV_MAX));
+        local.clear();
+        remote.clear();
+        for (size_t i = 0; i < batch; ++i) {
+            local.push_back({ requests[i].ptr, requests[i].count });
+            remote.push_back({ (void *)requests[i].off, requests[i].count });
+        }
+        auto rc = process_vm_readv(pid, &local[0], batch, &remote[0], batch, 0);
+        if (rc == -1) {
+            if (unavailable(errno))
+                break;
+            rc = 0;
+        }
+
+        // The transfer stops at the first failure: attribute what we got to
+        // the requests in order, finish the one that failed through the
+        // fallback, then carry on after it.
+        size_t done = 0;
+        while (done < batch) {
+            auto &request = requests[done++];
+            request.result = std::min(size_t(rc), request.count);
+            rc -= request.result;
+            if (request.result != request.count) {
+                try {
+                    request.result = readRest(request.off, request.count, request.ptr, request.result);
+                }
+                catch (const std::exception &) {
+                    request.result = 0;
+                }
+                break;
+            }
+        }
+        requests += done;
+        count -= done;
+    }
+    if (count != 0)
+        Reader::readBatch(requests, count);
+}
+
 LiveProcess::LiveProcess(Elf::Object::sptr &ex, pid_t pid_,
             const PathReplacementList &repls, Dwarf::ImageCache &imageCache)
     : Process(
             ex ? ex : imageCache.getImageForName(procname(pid_, "exe")),
-            std::make_shared<CacheReader>(std::make_shared<LiveReader>(pid_, "mem")),
+            std::make_shared<CacheReader>(std::make_shared<ProcessVMReader>(pid_)),
             repls, imageCache)
     , pid(pid_)
 {
@@ -43,38 +43,51 @@ LzmaReader::size() const
     return lzma_index_uncompressed_size(index);
 }
 
+/*
+ * Find the block containing "offset", decompressing it if needed. Sets
+ * *blockOff to the offset of "offset" within the block.
+ */
+const std::vector<unsigned char> &
+LzmaReader::getBlock(off_t offset, size_t *blockOff) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    lzma_index_iter iter{};
+    lzma_index_iter_init(&iter, index);
+    if (bool(lzma_index_iter_locate(&iter, offset)))
+        throw (Exception() << "can't locate offset " << offset << " in index");
+    auto &uncompressed = lzBlocks[iter.block.uncompressed_stream_offset];
+    if (uncompressed.empty()) {
+        std::vector<unsigned char>compressed(iter.block.total_size);
+        upstream->readObj(iter.block.compressed_file_offset, &compressed[0], compressed.size());
+        lzma_block block{};
+        lzma_filter filters[LZMA_FILTERS_MAX + 1];
+        block.filters = filters;
+        block.header_size = lzma_block_header_size_decode(compressed[0]);
+        int rc = lzma_block_header_decode(&block, allocator(), &compressed[0]);
+        if (rc != LZMA_OK)
+            throw (Exception() << "can't decode block header: " << rc);
+        uncompressed.resize(iter.block.uncompressed_size);
+        size_t compressed_pos = block.header_size;
+        size_t uncompressed_pos = 0;
+        rc = lzma_block_buffer_decode(&block, allocator(),
+                &compressed[0], &compressed_pos, compressed.size(),
+                &uncompressed[0], &uncompressed_pos, uncompressed.size());
+        for (auto i = 0;  block.filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+            allocator()->free(allocator(), block.filters[i].options);
+        if ( rc != LZMA_OK)
+            throw (Exception() << "can't decode block buffer: " << rc);
+    }
+    *blockOff = offset - iter.block.uncompressed_stream_offset;
+    return uncompressed;
+}
+
 size_t
 LzmaReader::read(off_t offset, size_t size, char *data) const
 {
     size_t startSize = size;
     while (size != 0) {
-        lzma_index_iter iter{};
-        lzma_index_iter_init(&iter, index);
-        if (bool(lzma_index_iter_locate(&iter, offset)))
-            throw (Exception() << "can't locate offset " << offset << " in index");
-        auto &uncompressed = lzBlocks[iter.block.uncompressed_stream_offset];
-        if (uncompressed.empty()) {
-            std::vector<unsigned char>compressed(iter.block.total_size);
-            upstream->readObj(iter.block.compressed_file_offset, &compressed[0], compressed.size());
-            lzma_block block{};
-            lzma_filter filters[LZMA_FILTERS_MAX + 1];
-            block.filters = filters;
-            block.header_size = lzma_block_header_size_decode(compressed[0]);
-            int rc = lzma_block_header_decode(&block, allocator(), &compressed[0]);
-            if (rc != LZMA_OK)
-                throw (Exception() << "can't decode block header: " << rc);
-            uncompressed.resize(iter.block.uncompressed_size);
-            size_t compressed_pos = block.header_size;
-            size_t uncompressed_pos = 0;
-            rc = lzma_block_buffer_decode(&block, allocator(),
-                    &compressed[0], &compressed_pos, compressed.size(),
-                    &uncompressed[0], &uncompressed_pos, uncompressed.size());
-            for (auto i = 0;  block.filters[i].id != LZMA_VLI_UNKNOWN; ++i)
-                allocator()->free(allocator(), block.filters[i].options);
-            if ( rc != LZMA_OK)
-                throw (Exception() << "can't decode block buffer: " << rc);
-        }
-        size_t blockOff = offset - iter.block.uncompressed_stream_offset;
+        size_t blockOff;
+        auto &uncompressed = getBlock(offset, &blockOff);
         auto amount = std::min(uncompressed.size() - blockOff, size);
         memcpy(data, &uncompressed[blockOff], amount);
         size -= amount;
@@ -84,6 +97,30 @@ LzmaReader::read(off_t offset, size_t size, char *data) const
     return startSize - size;
 }
 
+const char *
+LzmaReader::view(off_t offset, size_t size) const
+{
+    // We can provide a view of anything that lies within a single block.
+    // Check that against the index before decompressing anything.
+    if (offset < 0 || offset >= this->size())
+        return nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        lzma_index_iter iter{};
+        lzma_index_iter_init(&iter, index);
+        if (bool(lzma_index_iter_locate(&iter, offset)))
+            return nullptr;
+        auto blockOff = offset - iter.block.uncompressed_stream_offset;
+        if (size > iter.block.uncompressed_size - blockOff)
+            return nullptr;
+    }
+    size_t blockOff;
+    auto &uncompressed = getBlock(offset, &blockOff);
+    if (size > uncompressed.size() - blockOff)
+        return nullptr;
+    return (const char *)&uncompressed[blockOff];
+}
+
 void
 LzmaReader::describe(std::ostream &os) const
 {
@@ -5,17 +5,20 @@
 #include "libpstack/dwarf.h"
 #include "libpstack/proc.h"
 #include "libpstack/ps_callback.h"
+#include "libpstack/symbolizer.h"
 
 #include <link.h>
 #include <unistd.h>
 
 #include <cassert>
+#include <algorithm>
 #include <climits>
 
 #include <iomanip>
 #include <iostream>
 #include <limits>
 #include <set>
+#include <unordered_map>
 #include <sys/ucontext.h>
 
 static size_t gMaxFrames = 1024; /* max number of frames to read */
@@ -176,8 +179,8 @@ operator << (std::ostream &os, const JSON<td_thr_type_e, ctx> &jt)
     }
 }
 
-static bool
-dieName(std::ostream &os, const Dwarf::DIE &die, bool first=true) {
+bool
+dieName(std::ostream &os, const Dwarf::DIE &die, bool first) {
 
     // use the specification DIE instead of this if we have one.
     auto spec = die.attribute(Dwarf::DW_AT_specification);
@@ -233,6 +236,9 @@ struct PrintableFrame {
         Dwarf::Unit::sptr u = frame->dwarf->lookupUnit(objIp);
         if (u) {
             Dwarf::DIE function = Dwarf::findEntryForAddr(objIp, Dwarf::DW_TAG_subprogram, u->root());
+            for (Dwarf::DIE inner; function
+                  && (inner = Dwarf::findEntryForAddr(objIp, Dwarf::DW_TAG_subprogram, function)); )
+                function = inner;
             if (function) {
                 frame->function = function;
                 std::ostringstream sos;
@@ -273,7 +279,7 @@ operator << (std::ostream &os, const JSON<std::pair<std::string, int>> &jt)
 }
 
 std::ostream &
-operator << (std::ostream &os, const JSON<std::pair<Elf::Sym *, std::string>> &js)
+operator << (std::ostream &os, const JSON<std::pair<const Elf::Sym *, std::string>> &js)
 {
     const auto &obj = js.object;
     return JObject(os)
@@ -286,12 +292,13 @@ operator << (std::ostream &os, const JSON<std::pair<Elf::Sym *, std::string>> &j
 }
 
 std::ostream &
-operator << (std::ostream &os, const JSON<Dwarf::StackFrame *, Process *> &jt)
+operator << (std::ostream &os, const JSON<Dwarf::StackFrame *, const Symbolizer *> &jt)
 {
     auto &frame =jt.object;
-    PstackOptions options;
-    options[doargs] = true;
-    PrintableFrame pframe(frame, 0, options);
+    // The symbolizer has the frame's details, unless it has no object.
+    static const Symbolizer::Result unknown;
+    auto symbols = jt.context->find(*frame);
+    const auto &sym = symbols ? *symbols : unknown;
 
     JObject jo(os);
     jo
@@ -300,14 +307,14 @@ operator << (std::ostream &os, const JSON<Dwarf::StackFrame *, Process *> &jt)
         jo
             .field("object", stringify(*frame->elf->io))
             .field("loadaddr", frame->elfReloc)
-            .field("source", pframe.source)
-            .field("die", pframe.dieName)
+            .field("source", sym.source)
+            .field("die", sym.dieName)
             .field("cfa", frame->cfa)
-            .field("offset", pframe.functionOffset)
-            .field("trampoline", pframe.isSignalFrame)
+            .field("offset", sym.functionOffset)
+            .field("trampoline", frame->cie != nullptr && frame->cie->isSignalHandler)
         ;
-    if (pframe.haveSym)
-        jo.field("symbol", std::make_pair(&pframe.symbol, pframe.symName));
+    if (sym.haveSym)
+        jo.field("symbol", std::make_pair(&sym.symbol, sym.symName));
     else
         jo.field("symbol", JsonNull());
 
@@ -315,7 +322,7 @@ operator << (std::ostream &os, const JSON<Dwarf::StackFrame *, Process *> &jt)
 }
 
 std::ostream &
-operator << (std::ostream &os, const JSON<ThreadStack, Process *> &ts)
+operator << (std::ostream &os, const JSON<ThreadStack, const Symbolizer *> &ts)
 {
     return JObject(os)
         .field("ti_tid", ts->info.ti_tid)
@@ -323,6 +330,18 @@ operator << (std::ostream &os, const JSON<ThreadStack, Process *> &ts)
         .field("ti_stack", ts->stack, ts.context);
 }
 
+std::ostream &
+operator << (std::ostream &os, const JSON<StackGroup, const Symbolizer *> &group)
+{
+    std::vector<lwpid_t> lwps;
+    for (auto thread : group->threads)
+        lwps.push_back(thread->info.ti_lid);
+    return JObject(os)
+        .field("count", group->threads.size())
+        .field("lwps", lwps)
+        .field("ti_stack", group->stack().stack, group.context);
+}
+
 struct ArgPrint {
     const Process &p;
     const struct Dwarf::StackFrame *frame;
@@ -558,6 +577,82 @@ Process::dumpStackText(std::ostream &os, const ThreadStack &thread,
     return os;
 }
 
+std::ostream &
+Process::dumpStackText(std::ostream &os, const StackGroup &group,
+      const PstackOptions &options) const
+{
+    os << std::dec;
+    os << "threads: " << group.threads.size() << ", lwps:";
+    const char *sep = " ";
+    for (auto thread : group.threads) {
+        os << sep << thread->info.ti_lid;
+        sep = ", ";
+    }
+    os << "\n";
+    int frameNo = 0;
+    for (auto frame : group.stack().stack)
+        dumpFrameText(os, PrintableFrame(frame, frameNo++, options), frame);
+    return os;
+}
+
+std::vector<StackGroup>
+groupStacks(const std::list<ThreadStack> &threads)
+{
+    struct StackHash {
+        size_t operator()(const std::vector<Elf::Addr> &pcs) const {
+            size_t hash = pcs.size();
+            for (auto pc : pcs)
+                hash = hash * 31 + std::hash<Elf::Addr>()(pc);
+            return hash;
+        }
+    };
+    std::unordered_map<std::vector<Elf::Addr>, size_t, StackHash> index;
+    std::vector<StackGroup> groups;
+    std::vector<Elf::Addr> pcs;
+    for (const auto &thread : threads) {
+        pcs.clear();
+        for (auto frame : thread.stack)
+            pcs.push_back(frame->rawIP());
+        auto inserted = index.emplace(pcs, groups.size());
+        if (inserted.second)
+            groups.emplace_back();
+        groups[inserted.first->second].threads.push_back(&thread);
+    }
+    std::stable_sort(groups.begin(), groups.end(),
+          [] (const StackGroup &l, const StackGroup &r) {
+              return l.threads.size() > r.threads.size(); });
+    return groups;
+}
+
+std::vector<std::string>
+Process::frameFunctions(Dwarf::StackFrame *frame) const
+{
+    PstackOptions options;
+    options.set(PstackOption::nosrc);
+    PrintableFrame pframe(frame, 0, options);
+    std::vector<std::string> names;
+    if (pframe.dieName != "") {
+        names.push_back(pframe.dieName);
+    } else if (pframe.symName != "") {
+        names.push_back(pframe.symName);
+    } else {
+        // No name: use the object and offset, which are stable across runs.
+        std::ostringstream os;
+        if (frame->elf) {
+            auto object = stringify(*frame->elf->io);
+            os << object.substr(object.rfind('/') + 1) << "+";
+        }
+        os << "0x" << std::hex << frame->rawIP() - frame->elfReloc;
+        names.push_back(os.str());
+    }
+    for (const auto &inlined : pframe.inlined) {
+        std::ostringstream os;
+        ::dieName(os, inlined);
+        names.push_back(os.str());
+    }
+    return names;
+}
+
 std::ostream &
 Process::dumpFrameText(std::ostream &os, const PrintableFrame &pframe,
         Dwarf::StackFrame *frame) const
@@ -719,11 +814,11 @@ Process::findRDebugAddr()
      */
     if (interpBase && execImage->getInterpreter() != "") {
         try {
-            addElfObject(imageCache.getImageForName(execImage->getInterpreter()), interpBase);
+            auto interp = imageCache.getImageForName(execImage->getInterpreter());
+            addElfObject(interp, interpBase);
             return findSymbol("_r_debug", false,
-                  [this](const Elf::Addr, const Elf::Object::sptr &o) {
-                      auto name = stringify(*o->io);
-                      return execImage->getInterpreter() == name;
+                  [&interp](const Elf::Addr, const Elf::Object::sptr &o) {
+                      return o == interp;
                   });
         }
         catch (...) {
@@ -789,11 +884,11 @@ Process::~Process()
 }
 
 void
-ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
+ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, Dwarf::FrameArena &arena)
 {
     stack.clear();
     try {
-        auto curFrame = new Dwarf::StackFrame(Dwarf::UnwindMechanism::MACHINEREGS);
+        auto curFrame = arena.make(Dwarf::UnwindMechanism::MACHINEREGS);
         auto startFrame = curFrame;
         const Dwarf::StackFrame *prevFrame = 0;
 
@@ -808,7 +903,7 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
             stack.push_back(curFrame);
             nextFrame = 0;
             try {
-               nextFrame = curFrame->unwind(p);
+               nextFrame = curFrame->unwind(p, arena);
             }
             catch (const std::exception &ex) {
 
@@ -838,7 +933,7 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
                 if ((curFrame == startFrame ||
                          (prevFrame->cie && prevFrame->cie->isSignalHandler)) &&
                    (curFrame->phdr == 0 || (curFrame->phdr->p_flags & PF_X) == 0)) {
-                    nextFrame = new Dwarf::StackFrame(*curFrame,
+                    nextFrame = arena.make(*curFrame,
                           Dwarf::UnwindMechanism::BAD_IP_RECOVERY);
                     // get stack pointer in the current frame, and read content of
                     // TOS
@@ -893,7 +988,7 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
                            { 14, REG_FS }
                        };
                        p.io->readObj(sigContextAddr, &regs);
-                       nextFrame = new Dwarf::StackFrame(*curFrame,
+                       nextFrame = arena.make(*curFrame,
                              Dwarf::UnwindMechanism::TRAMPOLINE);
                        for (auto &reg : gregmap)
                            nextFrame->setReg(reg.dwarf, regs[reg.greg]);
@@ -913,7 +1008,7 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
                 p.io->readObj(oldBp + ELF_BYTES, &newIp);
                 p.io->readObj(oldBp, &newBp);
                 if (newBp > oldBp && newIp > 4096) {
-                    nextFrame = new Dwarf::StackFrame(*curFrame,
+                    nextFrame = arena.make(*curFrame,
                           Dwarf::UnwindMechanism::FRAMEPOINTER);
                     nextFrame->setReg(SPREG, oldBp + ELF_BYTES * 2);
                     nextFrame->setReg(BPREG, newBp);
@@ -1,6 +1,10 @@
+#define REGMAP(a,b)
+#include "libpstack/dwarf/archreg.h"
 #include "libpstack/dwarf.h"
 #include "libpstack/proc.h"
 #include "libpstack/ps_callback.h"
+#include "libpstack/snapshot.h"
+#include "libpstack/symbolizer.h"
 #if defined(WITH_PYTHON2) || defined(WITH_PYTHON3)
 #define WITH_PYTHON
 #include "libpstack/python.h"
@@ -9,32 +13,102 @@
 #include <sys/types.h>
 #include <sys/signal.h>
 
+#include <getopt.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cmath>
 #include <csignal>
 
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define XSTR(a) #a
 #define STR(a) XSTR(a)
-extern std::ostream & operator << (std::ostream &os, const JSON<ThreadStack, Process *> &jt);
+extern std::ostream & operator << (std::ostream &os, const JSON<ThreadStack, const Symbolizer *> &jt);
+extern std::ostream & operator << (std::ostream &os, const JSON<StackGroup, const Symbolizer *> &jt);
 
 namespace {
 bool doJson = false;
+bool groupThreads = false; // print each distinct stack once.
+unsigned jobs = 1;
+size_t snapshotSize = 0; // bytes of each thread's stack to copy before resuming.
+double profileHz = 0; // if set, sample this often, and print folded stacks.
+double profileSeconds = 0; // how long to profile for: 0 means until interrupted.
 volatile bool interrupted = false;
+std::unique_ptr<Snapshot::Writer> snapshotWriter; // if set, write binary snapshots, not text.
+Dwarf::FrameArena frameArena; // holds the frames from each pass, reused by the next.
 
-int usage(const char *);
-std::ostream &
-pstack(Process &proc, std::ostream &os, const PstackOptions &options)
+typedef std::vector<std::pair<ThreadStack *, Elf::CoreRegisters>> UnwindList;
+
+/*
+ * Unwind each thread from its captured registers. With more than one job,
+ * threads are handed out to a pool of workers.
+ */
+void
+unwindThreads(Process &proc, UnwindList &threads)
+{
+    size_t workers = std::min(size_t(jobs), threads.size());
+    std::atomic<size_t> next(0);
+    auto work = [&proc, &threads, &next] () {
+        for (size_t i; (i = next++) < threads.size(); )
+            threads[i].first->unwind(proc, threads[i].second, frameArena);
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; ++i)
+        pool.emplace_back(work);
+    work();
+    for (auto &worker : pool)
+        worker.join();
+}
+
+/*
+ * Substitutes a process's memory reader for the lifetime of this object.
+ */
+struct ReaderOverride {
+    Process &proc;
+    Reader::sptr saved;
+    ReaderOverride(Process &proc_, Reader::sptr replacement)
+        : proc(proc_)
+        , saved(proc.io)
+    {
+        proc.io = std::move(replacement);
+    }
+    ~ReaderOverride() { proc.io = saved; }
+};
+
+/*
+ * Releases the frames in frameArena when a pass is finished with them.
+ */
+struct ArenaReset {
+    ~ArenaReset() { frameArena.reset(); }
+};
+
+/*
+ * Stop the process, and unwind the stack of each of its threads. If we only
+ * snapshot the stacks while it's stopped, the returned override keeps the
+ * process reading from the snapshot for as long as the caller holds it.
+ */
+std::unique_ptr<ReaderOverride>
+captureStacks(Process &proc, std::list<ThreadStack> &threadStacks)
 {
-    // get its back trace.
-    std::list<ThreadStack> threadStacks;
     std::set<pid_t> tracedLwps;
+    UnwindList toUnwind;
+    std::shared_ptr<SnapshotReader> snapshot;
     {
         StopProcess here(&proc);
-        proc.listThreads([&proc, &threadStacks, &tracedLwps] (const td_thrhandle_t *thr) {
+
+        // Capture the registers for every thread before unwinding any of them.
+        proc.listThreads([&threadStacks, &tracedLwps, &toUnwind] (const td_thrhandle_t *thr) {
 
             Elf::CoreRegisters regs;
             td_err_e the;
@@ -46,7 +120,7 @@ pstack(Process &proc, std::ostream &os, const PstackOptions &options)
             if (the == TD_OK) {
                 threadStacks.push_back(ThreadStack());
                 td_thr_get_info(thr, &threadStacks.back().info);
-                threadStacks.back().unwind(proc, regs);
+                toUnwind.emplace_back(&threadStacks.back(), regs);
                 tracedLwps.insert(threadStacks.back().info.ti_lid);
             }
 
@@ -58,17 +132,82 @@ pstack(Process &proc, std::ostream &os, const PstackOptions &options)
                 threadStacks.back().info.ti_lid = lwp.first;
                 Elf::CoreRegisters regs;
                 proc.getRegs(lwp.first,  &regs);
-                threadStacks.back().unwind(proc, regs);
+                toUnwind.emplace_back(&threadStacks.back(), regs);
+            }
+        }
+
+        if (snapshotSize == 0) {
+            unwindThreads(proc, toUnwind);
+        } else {
+            // Just copy the top of each stack (including the red zone below
+            // the stack pointer), and unwind once the process is running again.
+            snapshot = std::make_shared<SnapshotReader>(proc.io);
+            for (auto &thread : toUnwind) {
+                Dwarf::StackFrame frame(Dwarf::UnwindMechanism::MACHINEREGS);
+                frame.setCoreRegs(thread.second);
+                snapshot->capture(frame.getReg(SPREG) - 128, snapshotSize + 128);
             }
+            // The loaded images' read-only segments (text, rodata, and
+            // unwind tables) can't change, so they're still read live.
+            for (auto &loaded : proc.objects)
+                for (auto &phdr : loaded.second->getSegments(PT_LOAD))
+                    if ((phdr.p_flags & PF_W) == 0)
+                        snapshot->passThrough(loaded.first + phdr.p_vaddr, phdr.p_memsz);
         }
     }
 
+    // Unwind from the snapshot, and the read-only images. Anything else would
+    // be read from the running process, so it reads short instead.
+    std::unique_ptr<ReaderOverride> useSnapshot;
+    if (snapshot) {
+        useSnapshot = std::make_unique<ReaderOverride>(proc, snapshot);
+        unwindThreads(proc, toUnwind);
+    }
+    return useSnapshot;
+}
+
+int usage(const char *);
+std::ostream &
+pstack(Process &proc, std::ostream &os, const PstackOptions &options)
+{
+    ArenaReset arenaReset; // release this pass's frames when we're done.
+
+    // get its back trace.
+    std::list<ThreadStack> threadStacks;
+    auto useSnapshot = captureStacks(proc, threadStacks);
+
+    if (snapshotWriter) {
+        snapshotWriter->write(proc, threadStacks);
+        return os;
+    }
+
     /*
      * resume at this point - maybe a bit optimistic if a shared library gets
      * unloaded while we print stuff out, but worth the risk, normally.
      */
+    // Symbolize the frames for JSON output together, rather than frame by frame.
+    Symbolizer symbolizer(proc.imageCache, true);
     if (doJson) {
-        os << json(threadStacks, &proc);
+        for (const auto &thread : threadStacks)
+            for (auto frame : thread.stack)
+                symbolizer.add(*frame);
+        symbolizer.resolve();
+    }
+    if (groupThreads) {
+        auto groups = groupStacks(threadStacks);
+        if (doJson) {
+            JSONWriter writer(os);
+            os << json(groups, (const Symbolizer *)&symbolizer);
+        } else {
+            os << "process: " << *proc.io << "\n";
+            for (auto &group : groups) {
+                proc.dumpStackText(os, group, options);
+                os << std::endl;
+            }
+        }
+    } else if (doJson) {
+        JSONWriter writer(os);
+        os << json(threadStacks, (const Symbolizer *)&symbolizer);
     } else {
         os << "process: " << *proc.io << "\n";
         for (auto &s : threadStacks) {
@@ -79,6 +218,167 @@ pstack(Process &proc, std::ostream &os, const PstackOptions &options)
     return os;
 }
 
+/*
+ * The stacks seen while profiling, as a trie of instruction addresses from
+ * the outermost frame in. Each node counts the samples whose stack ended
+ * there.
+ */
+class StackTrie {
+    struct Node {
+        Elf::Addr pc;
+        uint32_t parent;
+        size_t count;
+    };
+    struct EdgeHash {
+        size_t operator()(const std::pair<uint32_t, Elf::Addr> &edge) const {
+            return std::hash<Elf::Addr>()(edge.second * 31 + edge.first);
+        }
+    };
+    std::vector<Node> nodes { { 0, 0, 0 } };
+    std::unordered_map<std::pair<uint32_t, Elf::Addr>, uint32_t, EdgeHash> children;
+public:
+    static const uint32_t ROOT = 0;
+    uint32_t child(uint32_t parent, Elf::Addr pc) {
+        auto inserted = children.emplace(std::make_pair(parent, pc), uint32_t(nodes.size()));
+        if (inserted.second)
+            nodes.push_back({ pc, parent, 0 });
+        return inserted.first->second;
+    }
+    void count(uint32_t node) { nodes[node].count++; }
+    size_t size() const { return nodes.size(); }
+    template <typename F> void forEachStack(F callback) const;
+};
+
+/*
+ * Call "callback" with each stack that was sampled, outermost frame first,
+ * and the number of samples.
+ */
+template <typename F> void
+StackTrie::forEachStack(F callback) const
+{
+    std::vector<Elf::Addr> pcs;
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].count == 0)
+            continue;
+        pcs.clear();
+        for (uint32_t node = i; node != ROOT; node = nodes[node].parent)
+            pcs.push_back(nodes[node].pc);
+        std::reverse(pcs.begin(), pcs.end());
+        callback(pcs, nodes[i].count);
+    }
+}
+
+/*
+ * Check if a live process has exited, including one that's not yet reaped.
+ */
+bool
+exited(pid_t pid)
+{
+    std::ifstream stat(stringify("/proc/", pid, "/stat"));
+    std::string line;
+    if (!std::getline(stat, line))
+        return true;
+    // The state follows the command name, which is in parentheses.
+    auto paren = line.rfind(')');
+    if (paren == std::string::npos || paren + 2 >= line.size())
+        return true;
+    char state = line[paren + 2];
+    return state == 'Z' || state == 'X';
+}
+
+/*
+ * Sample the stacks of every thread "profileHz" times a second, and print the
+ * result in the "folded" format used to draw flame graphs: each distinct
+ * stack as a line of semicolon-separated function names, and a count.
+ */
+void
+profile(Process &proc, std::ostream &os)
+{
+    StackTrie trie;
+    std::unordered_map<Elf::Addr, std::string> names; // folded names, by PC.
+    auto live = dynamic_cast<LiveProcess *>(&proc);
+    size_t samples = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / profileHz));
+    auto next = start;
+    while (!interrupted && (profileSeconds == 0 ||
+             std::chrono::steady_clock::now() - start < std::chrono::duration<double>(profileSeconds))) {
+        if (live && exited(live->getPID()))
+            break;
+        bool sampled = false;
+        try {
+            ArenaReset arenaReset;
+            std::list<ThreadStack> threadStacks;
+            auto useSnapshot = captureStacks(proc, threadStacks);
+            for (auto &thread : threadStacks) {
+                auto node = StackTrie::ROOT;
+                for (auto frame = thread.stack.rbegin(); frame != thread.stack.rend(); ++frame) {
+                    Elf::Addr pc = (*frame)->scopeIP();
+                    node = trie.child(node, pc);
+                    // Symbolize each address the first time we see it.
+                    auto &name = names[pc];
+                    if (name == "") {
+                        for (const auto &function : proc.frameFunctions(*frame))
+                            name += (name == "" ? "" : ";") + function;
+                    }
+                }
+                trie.count(node);
+                sampled = true;
+            }
+            // With no threads left, there's nothing more to sample.
+            if (!sampled)
+                break;
+        }
+        catch (const std::exception &ex) {
+            // Keep what we've sampled so far.
+            if (verbose)
+                *debug << "failed to sample stacks: " << ex.what() << "\n";
+        }
+        if (sampled)
+            samples++;
+        next += interval;
+        auto now = std::chrono::steady_clock::now();
+        if (next < now)
+            next = now; // we can't keep up: sample as often as we can.
+        else
+            std::this_thread::sleep_until(next);
+    }
+
+    trie.forEachStack([&os, &names] (const std::vector<Elf::Addr> &pcs, size_t count) {
+        const char *sep = "";
+        for (auto pc : pcs) {
+            os << sep << names[pc];
+            sep = ";";
+        }
+        os << " " << count << "\n";
+    });
+    if (verbose)
+        *debug << samples << " samples, " << trie.size() - 1 << " stack nodes, "
+            << names.size() << " distinct instruction addresses\n";
+}
+
+/*
+ * Print the stacks in a file of binary snapshots, finding the images they
+ * refer to on this host.
+ */
+void
+decode(const std::string &file, Dwarf::ImageCache &imageCache, const PstackOptions &options)
+{
+    std::ifstream in;
+    if (file != "-") {
+        in.open(file, std::ios::binary);
+        if (!in)
+            throw (Exception() << "can't open " << file << ": " << strerror(errno));
+    }
+    Snapshot::Decoder decoder(file == "-" ? std::cin : in);
+    Snapshot::Capture capture;
+    while (decoder.next(capture))
+        Snapshot::print(std::cout, capture, imageCache, options);
+}
+
+#if defined(WITH_PYTHON)
 template<int V> bool doPy(Process &proc, std::ostream &o, const PstackOptions &options) {
     try {
         PythonPrinter<V> printer(proc, o, options);
@@ -91,6 +391,26 @@ template<int V> bool doPy(Process &proc, std::ostream &o, const PstackOptions &o
     }
     return true;
 }
+#endif
+
+// Parse an option's argument as a number greater than zero.
+static bool
+parsePositive(const char *arg, double &value)
+{
+    char *end;
+    value = strtod(arg, &end);
+    return end != arg && *end == '\0' && value > 0 && std::isfinite(value);
+}
+
+// Parse an option's argument as a whole number no larger than "max".
+static bool
+parseCount(const char *arg, unsigned long long max, unsigned long long &value)
+{
+    char *end;
+    errno = 0;
+    value = strtoull(arg, &end, 0);
+    return isdigit((unsigned char)*arg) && *end == '\0' && errno == 0 && value <= max;
+}
 
 int
 emain(int argc, char **argv)
@@ -107,23 +427,37 @@ emain(int argc, char **argv)
     bool python = false;
 #endif
     bool coreOnExit = false;
+    std::string decodeFile;
+    std::ofstream snapshotFile;
 
-    while ((c = getopt(argc, argv, "F:b:d:CD:hjsVvag:ptz:")) != -1) {
+    enum { DECODE = 256, UNITCACHE, INDEXJOBS };
+    static const struct option longOptions[] = {
+        { "decode", required_argument, nullptr, DECODE },
+        { "unit-cache", required_argument, nullptr, UNITCACHE },
+        { "index-jobs", required_argument, nullptr, INDEXJOBS },
+        { nullptr, 0, nullptr, 0 }
+    };
+    while ((c = getopt_long(argc, argv, "F:b:c:d:CD:hjJ:o:P:sS:T:UVvag:ptz:", longOptions, nullptr)) != -1) {
         switch (c) {
         case 'F': g_openPrefix = optarg;
                   break;
         case 'g':
             Elf::globalDebugDirectories.add(optarg);
             break;
+        case 'c':
+            imageCache.indexDirectory = optarg;
+            break;
         case 'D': {
             auto dumpobj = std::make_shared<Elf::Object>(imageCache, loadFile(optarg));
             auto di = std::make_shared<Dwarf::Info>(dumpobj, imageCache);
+            JSONWriter writer(std::cout);
             std::cout << json(*di);
             goto done;
         }
         case 'z':
         case 'd': {
             /* Undocumented option to dump image contents */
+            JSONWriter writer(std::cout);
             std::cout << json(Elf::Object(imageCache, loadFile(optarg)));
             goto done;
         }
@@ -136,9 +470,64 @@ emain(int argc, char **argv)
         case 'j':
             doJson = true;
             break;
+        case 'J': {
+            unsigned long long count;
+            if (!parseCount(optarg, std::numeric_limits<unsigned>::max(), count) || count == 0)
+                return usage(argv[0]);
+            jobs = count;
+            break;
+        }
+        case 'o':
+            if (strcmp(optarg, "-") != 0) {
+                snapshotFile.open(optarg, std::ios::binary | std::ios::trunc);
+                if (!snapshotFile) {
+                    std::cerr << "can't open " << optarg << ": " << strerror(errno) << "\n";
+                    return EX_CANTCREAT;
+                }
+            }
+            snapshotWriter = std::make_unique<Snapshot::Writer>(
+                  snapshotFile.is_open() ? snapshotFile : std::cout);
+            break;
+        case DECODE:
+            decodeFile = optarg;
+            break;
+        case UNITCACHE: {
+            unsigned long long megabytes;
+            if (!parseCount(optarg, std::numeric_limits<size_t>::max() / (1024 * 1024), megabytes))
+                return usage(argv[0]);
+            imageCache.unitCacheBudget = megabytes * 1024 * 1024;
+            break;
+        }
+        case INDEXJOBS: {
+            unsigned long long indexJobs;
+            if (!parseCount(optarg, std::numeric_limits<unsigned>::max(), indexJobs) || indexJobs == 0)
+                return usage(argv[0]);
+            imageCache.indexJobs = indexJobs;
+            break;
+        }
+        case 'P':
+            if (!parsePositive(optarg, profileHz))
+                return usage(argv[0]);
+            break;
+        case 'T':
+            if (!parsePositive(optarg, profileSeconds))
+                return usage(argv[0]);
+            break;
+        case 'U':
+            groupThreads = true;
+            break;
         case 's':
             options.set(PstackOption::nosrc);
             break;
+        case 'S': {
+            // Leave room for the red zone that's copied along with the stack.
+            unsigned long long kilobytes;
+            if (!parseCount(optarg, (std::numeric_limits<size_t>::max() - 128) / 1024, kilobytes)
+                  || kilobytes == 0)
+                return usage(argv[0]);
+            snapshotSize = kilobytes * 1024;
+            break;
+        }
         case 'v':
             verbose++;
             break;
@@ -167,6 +556,32 @@ emain(int argc, char **argv)
         }
     }
 
+    // Threads grouped by -U share instruction addresses, not argument values.
+    if (groupThreads && options[PstackOption::doargs]) {
+        std::clog << "-a can't be used with -U\n";
+        return usage(argv[0]);
+    }
+    // Arguments are often in memory that -S doesn't capture.
+    if (snapshotSize != 0 && options[PstackOption::doargs]) {
+        std::clog << "-a can't be used with -S\n";
+        return usage(argv[0]);
+    }
+    // A snapshot is written instead of any text or JSON output.
+    if (snapshotWriter && (doJson || groupThreads)) {
+        std::clog << "-o can't be used with -j or -U\n";
+        return usage(argv[0]);
+    }
+    // Sampling only prints folded stacks.
+    if (profileHz != 0 && (snapshotWriter || doJson || groupThreads)) {
+        std::clog << "-P can't be used with -o, -j or -U\n";
+        return usage(argv[0]);
+    }
+
+    if (decodeFile != "") {
+        decode(decodeFile, imageCache, options);
+        goto done;
+    }
+
     if (optind == argc)
         return usage(argv[0]);
 
@@ -175,6 +590,10 @@ emain(int argc, char **argv)
         try {
             auto doStack = [=, &options] (Process &proc) {
                 proc.load(options);
+                if (profileHz != 0) {
+                    profile(proc, std::cout);
+                    return;
+                }
                 while (!interrupted) {
 #if defined(WITH_PYTHON)
                    if (python) {
@@ -231,14 +650,30 @@ usage(const char *name)
         "or\n"
         "\t[-h]                         show this message\n"
         "or\n"
+        "\t[--decode <file>]            print the stacks in binary snapshot 'file'\n"
+        "or\n"
         "\t[-v]                         include verbose information to stderr\n"
         "\t[-V]                         dump git tag of source\n"
         "\t[-s]                         don't include source-level details\n"
         "\t[-g]                         add global debug directory\n"
+        "\t[-c<dir>]                    save and reuse indexes of ELF objects in 'dir'\n"
+        "\t[--unit-cache <MiB>]         keep up to 'MiB' of decoded DWARF for each object\n"
+        "\t[--index-jobs <n>]           index each object's DWARF up front with 'n' threads\n"
         "\t[-a]                         show arguments to functions where possible\n"
+        "\t[-U]                         print threads with identical stacks together\n"
+        "\t                             (not with -a)\n"
         "\t[-n]                         don't try to find external debug images\n"
         "\t[-t]                         don't try to use the thread_db library\n"
         "\t[-b<n>]                      batch mode: repeat every 'n' seconds\n"
+        "\t[-J<n>]                      unwind threads with 'n' parallel jobs\n"
+        "\t[-S<n>]                      copy top 'n' KiB of each stack, and unwind\n"
+        "\t                             after resuming the process, without the\n"
+        "\t                             heap or deeper stack (not with -a)\n"
+        "\t[-P<hz> [-T<seconds>]]       sample stacks 'hz' times a second, for 'seconds'\n"
+        "\t                             or until interrupted, and print folded stacks\n"
+        "\t                             (not with -o, -j or -U)\n"
+        "\t[-o<file>]                   write binary snapshots of the stacks to 'file'\n"
+        "\t                             (not with -j or -U)\n"
 #ifdef WITH_PYTHON
         "\t[-p]                         print python backtrace if available\n"
 #endif
@@ -261,7 +696,7 @@ main(int argc, char **argv)
         // Only interrupt cleanly once. Then just terminate, in case we're stuck in a loop
         sa.sa_flags = SA_RESETHAND;
         sigaction(SIGINT, &sa, nullptr);
-        emain(argc, argv);
+        return emain(argc, argv);
     }
     catch (std::exception &ex) {
         std::clog << "error: " << ex.what() << std::endl;
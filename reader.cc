@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <iostream>
@@ -104,6 +105,14 @@ MemReader::read(off_t off, size_t count, char *ptr) const
     return rc;
 }
 
+const char *
+MemReader::view(off_t off, size_t count) const
+{
+    if (off < 0 || size_t(off) > len || count > len - off)
+        return nullptr;
+    return data + off;
+}
+
 void
 MemReader::describe(std::ostream &os) const
 {
@@ -113,6 +122,13 @@ MemReader::describe(std::ostream &os) const
 std::string
 Reader::readString(off_t offset) const
 {
+    off_t avail = size() - offset;
+    const char *p = avail > 0 ? view(offset, avail) : nullptr;
+    if (p != nullptr) {
+        auto nul = static_cast<const char *>(memchr(p, 0, avail));
+        return string(p, nul ? nul - p : avail);
+    }
+
     string res;
     for (off_t s = size(); offset < s; ++offset) {
         char c;
@@ -125,6 +141,19 @@ Reader::readString(off_t offset) const
     return res;
 }
 
+void
+Reader::readBatch(ReadRequest *requests, size_t count) const
+{
+    for (size_t i = 0; i < count; ++i) {
+        try {
+            requests[i].result = read(requests[i].off, requests[i].count, requests[i].ptr);
+        }
+        catch (const std::exception &) {
+            requests[i].result = 0;
+        }
+    }
+}
+
 size_t
 FileReader::read(off_t off, size_t count, char *ptr) const
 {
@@ -138,83 +167,135 @@ FileReader::read(off_t off, size_t count, char *ptr) const
     return rc;
 }
 
-void
-CacheReader::Page::load(const Reader &r, off_t offset_)
-{
-    assert(offset_ % PAGESIZE == 0);
-    try {
-        len = r.read(offset_, PAGESIZE, data);
-        offset = offset_;
-    }
-    catch (std::exception &ex) {
-        len = 0;
-    }
-}
-
-CacheReader::CacheReader(Reader::csptr upstream_)
+CacheReader::CacheReader(Reader::csptr upstream_, size_t pageSize_, size_t maxPages_)
     : upstream(move(upstream_))
+    , pageSize(pageSize_)
+    , maxPages(std::max(maxPages_, size_t(1)))
 {
 }
 
 void
 CacheReader::flush() {
-    std::list<Page *> clearpages;
-    std::swap(pages, clearpages);
-    for (auto &i : clearpages)
-        delete i;
+    std::lock_guard<std::mutex> guard(lock);
+    pageIndex.clear();
+    pages.clear();
 }
 
 CacheReader::~CacheReader()
 {
-    flush();
+    if (verbose > 1)
+        *debug << "page cache for " << *upstream << ": " << stats.hits << " hits, "
+            << stats.misses << " misses, " << stats.evictions << " evictions\n";
 }
 
-CacheReader::Page *
+const CacheReader::Page &
 CacheReader::getPage(off_t pageoff) const
 {
-    Page *p;
-    bool first = true;
-    for (auto i = pages.begin(); i != pages.end(); ++i) {
-        p = *i;
-        if (p->offset == pageoff) {
-            // move page to front.
-            if (!first) {
-                pages.erase(i);
-                pages.push_front(p);
-            }
-            return p;
-        }
-        first = false;
+    auto found = pageIndex.find(pageoff);
+    if (found != pageIndex.end()) {
+        stats.hits++;
+        // move page to front.
+        pages.splice(pages.begin(), pages, found->second);
+        return *found->second;
+    }
+
+    stats.misses++;
+    Page &p = newPage(pageoff);
+    try {
+        p.len = upstream->read(pageoff, pageSize, p.data.get());
+    }
+    catch (std::exception &ex) {
+        p.len = 0;
     }
-    if (pages.size() == MAXPAGES) {
-        p = pages.back();
-        pages.pop_back();
+    return p;
+}
+
+/*
+ * Make a page for "pageoff" the most recently used, recycling the least
+ * recently used page if the cache is full. The content is left to the caller.
+ */
+CacheReader::Page &
+CacheReader::newPage(off_t pageoff) const
+{
+    if (pages.size() >= maxPages) {
+        // Recycle the least recently used page and its buffer.
+        stats.evictions++;
+        pageIndex.erase(pages.back().offset);
+        pages.splice(pages.begin(), pages, std::prev(pages.end()));
     } else {
-        p = new Page();
+        pages.emplace_front();
+        pages.front().data.reset(new char[pageSize]);
     }
-    p->load(*upstream, pageoff);
-    pages.push_front(p);
+    Page &p = pages.front();
+    p.offset = pageoff;
+    p.len = 0;
+    pageIndex[pageoff] = pages.begin();
     return p;
 }
 
+/*
+ * Fetch all the pages the requests need but we don't have in a single batch
+ * from upstream, then satisfy the requests from the cache.
+ */
+void
+CacheReader::readBatch(ReadRequest *requests, size_t count) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<off_t> missing;
+    for (size_t i = 0; i < count; ++i) {
+        if (requests[i].count == 0)
+            continue;
+        off_t first = requests[i].off - requests[i].off % pageSize;
+        off_t last = requests[i].off + requests[i].count - 1;
+        for (off_t page = first; page <= last; page += pageSize)
+            if (pageIndex.find(page) == pageIndex.end())
+                missing.push_back(page);
+    }
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+    // Don't let the batch evict its own pages before we use them.
+    if (missing.size() > 1 && missing.size() <= maxPages / 2) {
+        std::vector<ReadRequest> pageRequests;
+        pageRequests.reserve(missing.size());
+        for (auto pageoff : missing) {
+            stats.misses++;
+            Page &p = newPage(pageoff);
+            pageRequests.push_back({ pageoff, pageSize, p.data.get(), 0 });
+        }
+        upstream->readBatch(&pageRequests[0], pageRequests.size());
+        for (const auto &req : pageRequests)
+            pageIndex[req.off]->len = req.result;
+    }
+    for (size_t i = 0; i < count; ++i)
+        requests[i].result = readPages(requests[i].off, requests[i].count, requests[i].ptr);
+}
+
 size_t
 CacheReader::read(off_t off, size_t count, char *ptr) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return readPages(off, count, ptr);
+}
+
+size_t
+CacheReader::readPages(off_t off, size_t count, char *ptr) const
 {
     off_t startoff = off;
     for (;;) {
         if (count == 0)
             break;
-        size_t offsetOfDataInPage = off % PAGESIZE;
+        size_t offsetOfDataInPage = off % pageSize;
         off_t offsetOfPageInFile = off - offsetOfDataInPage;
-        Page *page = getPage(offsetOfPageInFile);
-        if (page == nullptr)
+        const Page &page = getPage(offsetOfPageInFile);
+        if (page.len <= offsetOfDataInPage)
             break;
-        size_t chunk = std::min(page->len - offsetOfDataInPage, count);
-        memcpy(ptr, page->data + offsetOfDataInPage, chunk);
+        size_t chunk = std::min(page.len - offsetOfDataInPage, count);
+        memcpy(ptr, page.data.get() + offsetOfDataInPage, chunk);
         off += chunk;
         count -= chunk;
         ptr += chunk;
-        if (page->len != PAGESIZE)
+        if (page.len != pageSize)
             break;
     }
     return off - startoff;
@@ -223,26 +304,128 @@ CacheReader::read(off_t off, size_t count, char *ptr) const
 string
 CacheReader::readString(off_t off) const
 {
-    auto &entry = stringCache[off];
-    if (entry.isNew) {
-        entry.value = Reader::readString(off);
-        entry.isNew = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto entry = stringCache.find(off);
+        if (entry != stringCache.end())
+            return entry->second;
+    }
+    auto value = Reader::readString(off);
+    std::lock_guard<std::mutex> guard(lock);
+    stringCache.emplace(off, value);
+    return value;
+}
+
+/*
+ * Copy up to "count" bytes at "off" from upstream. Returns the number of
+ * bytes captured, which may be short if the range runs into unreadable data.
+ */
+size_t
+SnapshotReader::capture(off_t off, size_t count)
+{
+    std::vector<char> data(count);
+    size_t got = upstream->read(off, count, &data[0]);
+    if (got != 0) {
+        data.resize(got);
+        data.shrink_to_fit();
+        ranges[off] = std::move(data);
     }
-    return entry.value;
+    return got;
+}
+
+/*
+ * Let reads of "count" bytes at "off" through to upstream. Ranges must not
+ * overlap.
+ */
+void
+SnapshotReader::passThrough(off_t off, size_t count)
+{
+    if (count != 0)
+        liveRanges[off] = off + count;
+}
+
+size_t
+SnapshotReader::read(off_t off, size_t count, char *ptr) const
+{
+    size_t total = 0;
+    while (count != 0) {
+        auto it = ranges.upper_bound(off);
+        if (it != ranges.begin()) {
+            --it;
+            size_t rangeOff = off - it->first;
+            if (rangeOff < it->second.size()) {
+                size_t chunk = std::min(count, it->second.size() - rangeOff);
+                memcpy(ptr, &it->second[rangeOff], chunk);
+                off += chunk;
+                ptr += chunk;
+                count -= chunk;
+                total += chunk;
+                continue;
+            }
+        }
+        // Not in the snapshot: only read through if upstream can't have
+        // changed here, and then up to the start of the next copied range.
+        auto live = liveRanges.upper_bound(off);
+        if (live == liveRanges.begin() || (--live)->second <= off)
+            break;
+        auto next = ranges.upper_bound(off);
+        size_t chunk = std::min(count, size_t(live->second - off));
+        if (next != ranges.end())
+            chunk = std::min(chunk, size_t(next->first - off));
+        size_t got = upstream->read(off, chunk, ptr);
+        total += got;
+        if (got != chunk)
+            break;
+        off += chunk;
+        ptr += chunk;
+        count -= chunk;
+    }
+    return total;
+}
+
+const char *
+SnapshotReader::view(off_t off, size_t count) const
+{
+    auto it = ranges.upper_bound(off);
+    if (it == ranges.begin())
+        return nullptr;
+    --it;
+    size_t rangeOff = off - it->first;
+    if (rangeOff > it->second.size() || count > it->second.size() - rangeOff)
+        return nullptr;
+    return &it->second[0] + rangeOff;
 }
 
 std::shared_ptr<const Reader>
 loadFile(const std::string &path)
 {
+    // Map the file if we can, so its content can be viewed in place. Things
+    // that can't be mapped (pipes, some /proc files) are read through a cache.
+    try {
+        return std::make_shared<MmapReader>(path);
+    }
+    catch (const Exception &ex) {
+        if (verbose > 1)
+            *debug << "can't map " << path << ", reading instead: " << ex.what() << "\n";
+    }
     return std::make_shared<CacheReader>(
         std::make_shared<FileReader>(path));
 }
 
 size_t
 MmapReader::read(off_t off, size_t count, char *ptr) const {
-   off_t size = std::min(count, len - size_t(off));
+   if (off < 0 || size_t(off) > len)
+      throw (Exception() << "read past end of " << *this);
+   size_t size = std::min(count, len - size_t(off));
    memcpy(ptr, (char *)base + off, size);
-   return count;
+   return size;
+}
+
+const char *
+MmapReader::view(off_t off, size_t count) const {
+   if (off < 0 || size_t(off) > len || count > len - off)
+      return nullptr;
+   return (const char *)base + off;
 }
 
 MmapReader::MmapReader(const std::string &name_)
@@ -250,17 +433,15 @@ MmapReader::MmapReader(const std::string &name_)
 {
    int fd = openfile(name);
    struct stat s;
-   fstat(fd, &s);
+   if (fstat(fd, &s) == -1 || !S_ISREG(s.st_mode) || s.st_size == 0) {
+      close(fd);
+      throw (Exception() << "can't map " << name << ": not a regular, non-empty file");
+   }
    len = s.st_size;
    base = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
    close(fd);
    if (base == MAP_FAILED)
-      throw (Exception() << "mmap failed" << strerror(errno));
-}
-
-std::string
-MmapReader::readString(off_t offset) const {
-   return std::string((char *)base + offset);
+      throw (Exception() << "mmap failed: " << strerror(errno));
 }
 
 MmapReader::~MmapReader() {
@@ -0,0 +1,437 @@
+#include "libpstack/snapshot.h"
+#include "libpstack/symbolizer.h"
+
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+
+namespace Snapshot {
+
+namespace {
+
+const char magic[8] = { 'p', 's', 't', 'k', 's', 'n', 'p', '1' };
+
+void
+putULEB(std::string &out, uintmax_t value)
+{
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+            byte |= 0x80;
+        out.push_back(byte);
+    } while (value != 0);
+}
+
+void
+putSLEB(std::string &out, intmax_t value)
+{
+    for (;;) {
+        unsigned char byte = value & 0x7f;
+        value >>= 7; // arithmetic shift: sign bits come in from the left.
+        if ((value == 0 && (byte & 0x40) == 0) || (value == -1 && (byte & 0x40) != 0)) {
+            out.push_back(byte);
+            return;
+        }
+        out.push_back(byte | 0x80);
+    }
+}
+
+void
+putString(std::string &out, const std::string &value)
+{
+    putULEB(out, value.size());
+    out += value;
+}
+
+/*
+ * Decodes the fields of a record's payload.
+ */
+class Payload {
+    const std::string &data;
+    size_t off = 0;
+public:
+    explicit Payload(const std::string &data_) : data(data_) {}
+    uintmax_t uleb() {
+        uintmax_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            if (off == data.size())
+                throw (Exception() << "truncated snapshot record");
+            if (shift >= int(sizeof value * 8))
+                throw (Exception() << "corrupt snapshot record");
+            unsigned char byte = data[off++];
+            value |= uintmax_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+    }
+    intmax_t sleb() {
+        intmax_t value = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            if (off == data.size())
+                throw (Exception() << "truncated snapshot record");
+            if (shift >= int(sizeof value * 8))
+                throw (Exception() << "corrupt snapshot record");
+            byte = data[off++];
+            value |= intmax_t(byte & 0x7f) << shift;
+            shift += 7;
+        } while ((byte & 0x80) != 0);
+        if (shift < int(sizeof value * 8) && (byte & 0x40) != 0)
+            value |= -(intmax_t(1) << shift);
+        return value;
+    }
+    std::string string() {
+        size_t len = uleb();
+        if (len > data.size() - off)
+            throw (Exception() << "truncated snapshot record");
+        off += len;
+        return data.substr(off - len, len);
+    }
+    size_t remaining() const { return data.size() - off; }
+};
+
+/*
+ * The function symbols of an object, for a module that we might not be able
+ * to find again when decoding.
+ */
+std::vector<Symbol>
+functionSymbols(const Elf::Object &obj)
+{
+    std::vector<Symbol> symbols;
+    auto add = [&symbols] (const auto &table) {
+        for (const auto &sym : table)
+            if (ELF_ST_TYPE(sym.symbol.st_info) == STT_FUNC && sym.symbol.st_value != 0)
+                symbols.push_back({ sym.symbol.st_value, sym.symbol.st_size, sym.name });
+    };
+    add(obj.commonSections->debugSymbols);
+    add(obj.commonSections->dynamicSymbols);
+    std::sort(symbols.begin(), symbols.end(),
+          [] (const Symbol &l, const Symbol &r) { return l.value < r.value; });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(),
+             [] (const Symbol &l, const Symbol &r) { return l.value == r.value; }),
+          symbols.end());
+    return symbols;
+}
+
+}
+
+Writer::Writer(std::ostream &os_) : os(os_)
+{
+    os.write(magic, sizeof magic);
+}
+
+void
+Writer::record(RecordType type, const std::string &payload)
+{
+    std::string header;
+    putULEB(header, type);
+    putULEB(header, payload.size());
+    os.write(header.data(), header.size());
+    os.write(payload.data(), payload.size());
+}
+
+void
+Writer::write(const Process &proc, const std::list<ThreadStack> &threads)
+{
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    std::string payload;
+    putULEB(payload, proc.getPID());
+    putULEB(payload, uint64_t(now.tv_sec) * 1000000 + now.tv_usec);
+    putString(payload, stringify(*proc.io));
+    record(PROCESS, payload);
+
+    // Modules are written as the first frame in each is seen.
+    std::map<std::pair<const Elf::Object *, Elf::Addr>, size_t> modules;
+    std::string frames;
+    for (const auto &thread : threads) {
+        frames.clear();
+        Elf::Addr cfa = 0;
+        for (auto frame : thread.stack) {
+            size_t module = 0;
+            Elf::Addr address = frame->rawIP();
+            if (frame->elf) {
+                auto inserted = modules.emplace(std::make_pair(frame->elf.get(), frame->elfReloc),
+                      modules.size() + 1);
+                if (inserted.second) {
+                    const auto &obj = *frame->elf;
+                    auto path = obj.io->filename();
+                    auto buildID = obj.getBuildID();
+                    payload.clear();
+                    putULEB(payload, frame->elfReloc);
+                    putString(payload, path);
+                    putString(payload, buildID);
+                    record(MODULE, payload);
+                    if (buildID == "" || access(path.c_str(), R_OK) != 0) {
+                        auto symbols = functionSymbols(obj);
+                        payload.clear();
+                        putULEB(payload, inserted.first->second);
+                        putULEB(payload, symbols.size());
+                        Elf::Addr value = 0;
+                        for (const auto &sym : symbols) {
+                            putULEB(payload, sym.value - value);
+                            putULEB(payload, sym.size);
+                            putString(payload, sym.name);
+                            value = sym.value;
+                        }
+                        record(SYMBOLS, payload);
+                    }
+                }
+                module = inserted.first->second;
+                address -= frame->elfReloc;
+            }
+            unsigned flags = 0;
+            if (frame->cie != nullptr && frame->cie->isSignalHandler)
+                flags |= SIGNAL_FRAME;
+            if (frame->scopeIP() == frame->rawIP())
+                flags |= EXACT_IP;
+            putULEB(frames, module);
+            putULEB(frames, address);
+            // CFAs are close together: store each as a delta from the last.
+            putSLEB(frames, intmax_t(frame->cfa - cfa));
+            putULEB(frames, flags);
+            cfa = frame->cfa;
+        }
+        payload.clear();
+        putULEB(payload, thread.info.ti_lid);
+        putULEB(payload, uint64_t(thread.info.ti_tid));
+        putULEB(payload, thread.stack.size());
+        payload += frames;
+        record(THREAD, payload);
+    }
+    os.flush();
+}
+
+Decoder::Decoder(std::istream &is_) : is(is_)
+{
+    char header[sizeof magic];
+    if (!is.read(header, sizeof header) || memcmp(header, magic, sizeof magic) != 0)
+        throw (Exception() << "not a pstack snapshot");
+}
+
+bool
+Decoder::readRecord(unsigned &type, std::string &payload)
+{
+    std::string header;
+    auto uleb = [this, &header] () {
+        header.clear();
+        for (;;) {
+            int c = is.get();
+            if (c == EOF)
+                return false;
+            // No 64-bit value needs more than 10 bytes.
+            if (header.size() == 10)
+                throw (Exception() << "corrupt snapshot record");
+            header.push_back(char(c));
+            if ((c & 0x80) == 0)
+                return true;
+        }
+    };
+    if (!uleb())
+        return false;
+    type = Payload(header).uleb();
+    if (!uleb())
+        throw (Exception() << "truncated snapshot record");
+    // Don't trust the length enough to allocate it up front: grow the
+    // payload as the data actually arrives.
+    uintmax_t size = Payload(header).uleb();
+    payload.clear();
+    while (payload.size() != size) {
+        size_t chunk = std::min(size - payload.size(), uintmax_t(1) << 20);
+        size_t have = payload.size();
+        payload.resize(have + chunk);
+        if (!is.read(&payload[have], chunk))
+            throw (Exception() << "truncated snapshot record");
+    }
+    return true;
+}
+
+bool
+Decoder::next(Capture &capture)
+{
+    unsigned type;
+    std::string payload;
+    if (pending != "") {
+        payload.swap(pending);
+    } else {
+        // Skip anything before the first capture.
+        do {
+            if (!readRecord(type, payload))
+                return false;
+        } while (type != PROCESS);
+    }
+    Payload process(payload);
+    capture.pid = process.uleb();
+    capture.time = process.uleb();
+    capture.description = process.string();
+    capture.modules.clear();
+    capture.threads.clear();
+
+    while (readRecord(type, payload)) {
+        Payload p(payload);
+        switch (type) {
+            case PROCESS:
+                pending.swap(payload);
+                return true;
+            case MODULE: {
+                Module module;
+                module.loadAddress = p.uleb();
+                module.path = p.string();
+                module.buildID = p.string();
+                capture.modules.push_back(std::move(module));
+                break;
+            }
+            case SYMBOLS: {
+                size_t idx = p.uleb();
+                if (idx == 0 || idx > capture.modules.size())
+                    throw (Exception() << "snapshot symbols for unknown module " << idx);
+                auto &symbols = capture.modules[idx - 1].symbols;
+                size_t count = p.uleb();
+                // Each symbol takes at least three bytes.
+                if (count > p.remaining() / 3)
+                    throw (Exception() << "truncated snapshot record");
+                symbols.resize(count);
+                Elf::Addr value = 0;
+                for (auto &sym : symbols) {
+                    value += p.uleb();
+                    sym.value = value;
+                    sym.size = p.uleb();
+                    sym.name = p.string();
+                }
+                break;
+            }
+            case THREAD: {
+                Thread thread;
+                thread.lwp = p.uleb();
+                thread.tid = p.uleb();
+                size_t count = p.uleb();
+                // Each frame takes at least four bytes.
+                if (count > p.remaining() / 4)
+                    throw (Exception() << "truncated snapshot record");
+                thread.frames.resize(count);
+                Elf::Addr cfa = 0;
+                for (auto &frame : thread.frames) {
+                    frame.module = p.uleb();
+                    if (frame.module > capture.modules.size())
+                        throw (Exception() << "snapshot frame in unknown module " << frame.module);
+                    frame.address = p.uleb();
+                    cfa += p.sleb();
+                    frame.cfa = cfa;
+                    frame.flags = p.uleb();
+                }
+                capture.threads.push_back(std::move(thread));
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+namespace {
+
+const Symbol *
+findEmbeddedSymbol(const std::vector<Symbol> &symbols, Elf::Addr addr)
+{
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), addr,
+          [] (Elf::Addr addr, const Symbol &sym) { return addr < sym.value; });
+    if (it == symbols.begin())
+        return nullptr;
+    --it;
+    return it->size == 0 || addr < it->value + it->size ? &*it : nullptr;
+}
+
+// The address of the instruction a frame was executing.
+Elf::Addr
+scopeAddress(const Frame &frame)
+{
+    return (frame.flags & EXACT_IP) ? frame.address : frame.address - 1;
+}
+
+}
+
+std::ostream &
+print(std::ostream &os, const Capture &capture, Dwarf::ImageCache &cache,
+      const PstackOptions &options)
+{
+    IOFlagSave _(os);
+
+    // Find the objects on this host, and symbolize all the frames at once.
+    Symbolizer symbolizer(cache, !options[PstackOption::nosrc]);
+    std::vector<Elf::Object::sptr> objects;
+    for (const auto &module : capture.modules)
+        objects.push_back(symbolizer.findObject(module.path, module.buildID));
+    for (const auto &thread : capture.threads)
+        for (const auto &frame : thread.frames)
+            if (frame.module != 0 && objects[frame.module - 1])
+                symbolizer.add(objects[frame.module - 1], scopeAddress(frame));
+    symbolizer.resolve();
+
+    time_t secs = capture.time / 1000000;
+    struct tm tm;
+    char when[64];
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+    os << "process: " << capture.description << ", pid " << std::dec << capture.pid
+        << ", at " << when << "." << std::setw(6) << std::setfill('0')
+        << capture.time % 1000000 << "\n";
+
+    for (const auto &thread : capture.threads) {
+        os << "thread: " << (void *)thread.tid << ", lwp: " << std::dec << thread.lwp << "\n";
+        int frameNo = 0;
+        for (const auto &frame : thread.frames) {
+            os << "#" << std::left << std::setw(2) << std::setfill(' ') << std::dec << frameNo++
+                << " " << std::right << "0x" << std::hex << std::setw(ELF_BITS/4)
+                << std::setfill('0') << frame.pc(capture.modules);
+            if (verbose > 0)
+                os << "/" << "0x" << std::setw(ELF_BITS/4) << std::setfill('0') << frame.cfa;
+            os << std::dec;
+            if (frame.module == 0) {
+                os << " no information for frame\n";
+                continue;
+            }
+            const auto &module = capture.modules[frame.module - 1];
+            Elf::Addr objIp = scopeAddress(frame);
+
+            std::string name;
+            std::string flags = (frame.flags & SIGNAL_FRAME) ? "*" : "";
+            Elf::Addr offset = std::numeric_limits<Elf::Addr>::max();
+            const Symbolizer::Result *result = objects[frame.module - 1]
+                ? symbolizer.find(objects[frame.module - 1].get(), objIp)
+                : nullptr;
+            if (result != nullptr) {
+                offset = result->functionOffset;
+                if (result->dieName != "") {
+                    name = result->dieName;
+                } else if (result->haveSym) {
+                    name = result->symName;
+                    flags += "!";
+                }
+            }
+            if (name == "") {
+                auto sym = findEmbeddedSymbol(module.symbols, objIp);
+                if (sym) {
+                    name = sym->name;
+                    flags += "!";
+                    offset = objIp - sym->value;
+                }
+            }
+            os << " in " << (name == "" ? "<unknown>" : name) << flags << "()";
+            if (offset != std::numeric_limits<Elf::Addr>::max())
+                os << "+" << offset;
+            os << " in " << module.path;
+            if (result != nullptr && !result->source.empty())
+                os << " at " << result->source[0].first << ":" << result->source[0].second;
+            os << "\n";
+        }
+        os << "\n";
+    }
+    return os;
+}
+
+}
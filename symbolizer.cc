@@ -0,0 +1,137 @@
+#include "libpstack/symbolizer.h"
+#include "libpstack/proc.h"
+
+Symbolizer::Symbolizer(Dwarf::ImageCache &cache_, bool wantSource_)
+    : cache(cache_)
+    , wantSource(wantSource_)
+{
+}
+
+Elf::Object::sptr
+Symbolizer::findObject(const std::string &path, const std::string &buildID)
+{
+    try {
+        auto obj = cache.getImageForName(path);
+        if (buildID == "" || obj->getBuildID() == buildID)
+            return obj;
+        if (verbose)
+            *debug << path << " does not have build ID " << buildID << "\n";
+    }
+    catch (const std::exception &ex) {
+        if (verbose)
+            *debug << "can't load " << path << ": " << ex.what() << "\n";
+    }
+    if (buildID.size() > 2)
+        return cache.getDebugImage(".build-id/" + buildID.substr(0, 2) + "/"
+              + buildID.substr(2) + ".debug");
+    return nullptr;
+}
+
+void
+Symbolizer::add(const Elf::Object::sptr &obj, Elf::Addr addr)
+{
+    objects.emplace(obj.get(), obj);
+    entries[std::make_pair(obj.get(), addr)];
+}
+
+void
+Symbolizer::add(const Dwarf::StackFrame &frame)
+{
+    if (frame.elf)
+        add(frame.elf, frame.scopeIP() - frame.elfReloc);
+}
+
+const Symbolizer::Result *
+Symbolizer::find(const Elf::Object *obj, Elf::Addr addr) const
+{
+    auto it = entries.find(std::make_pair(obj, addr));
+    return it != entries.end() && it->second.resolved ? &it->second.result : nullptr;
+}
+
+const Symbolizer::Result *
+Symbolizer::find(const Dwarf::StackFrame &frame) const
+{
+    return frame.elf ? find(frame.elf.get(), frame.scopeIP() - frame.elfReloc) : nullptr;
+}
+
+void
+Symbolizer::resolve()
+{
+    std::vector<std::pair<Elf::Addr, Result *>> batch;
+    const Elf::Object *current = nullptr;
+    for (auto &entry : entries) {
+        if (entry.second.resolved)
+            continue;
+        entry.second.resolved = true;
+        if (entry.first.first != current) {
+            if (current != nullptr)
+                resolveObject(objects[current], batch);
+            current = entry.first.first;
+            batch.clear();
+        }
+        batch.emplace_back(entry.first.second, &entry.second.result);
+    }
+    if (current != nullptr)
+        resolveObject(objects[current], batch);
+}
+
+/*
+ * Resolve the addresses in one object, in ascending order. Consecutive
+ * addresses are usually in the same unit, and often the same function, so
+ * we hang on to the last of each.
+ */
+void
+Symbolizer::resolveObject(const Elf::Object::sptr &obj,
+      std::vector<std::pair<Elf::Addr, Result *>> &batch)
+{
+    auto dwarf = cache.getDwarf(obj);
+    Dwarf::Unit::sptr unit;
+    Dwarf::DIE function;
+    std::vector<Elf::Addr> unitAddrs;
+    std::vector<std::vector<std::pair<std::string, int>>> unitSources;
+    std::vector<Result *> unitResults;
+
+    auto finishUnit = [&] () {
+        if (unit && wantSource && !unitAddrs.empty()) {
+            unitSources.assign(unitAddrs.size(), {});
+            Dwarf::sourcesInUnit(unit, unitAddrs.data(), unitAddrs.size(), unitSources.data());
+            for (size_t i = 0; i < unitResults.size(); ++i)
+                unitResults[i]->source = std::move(unitSources[i]);
+        }
+        unitAddrs.clear();
+        unitResults.clear();
+    };
+
+    for (auto &query : batch) {
+        auto addr = query.first;
+        auto &result = *query.second;
+        auto addrUnit = dwarf->lookupUnit(addr);
+        if (addrUnit != unit) {
+            finishUnit();
+            unit = addrUnit;
+            function = Dwarf::DIE();
+        }
+        if (unit) {
+            if (!function || function.containsAddress(addr) != Dwarf::ContainsAddr::YES)
+                function = Dwarf::findEntryForAddr(addr, Dwarf::DW_TAG_subprogram, unit->root());
+            // The address may be in a function nested inside this one.
+            for (Dwarf::DIE inner; function
+                  && (inner = Dwarf::findEntryForAddr(addr, Dwarf::DW_TAG_subprogram, function)); )
+                function = inner;
+            if (function) {
+                std::ostringstream sos;
+                dieName(sos, function);
+                result.dieName = sos.str();
+                auto lowpc = function.attribute(Dwarf::DW_AT_low_pc);
+                if (lowpc.valid())
+                    result.functionOffset = addr - uintmax_t(lowpc);
+            }
+            unitAddrs.push_back(addr);
+            unitResults.push_back(&result);
+        }
+        result.haveSym = obj->findSymbolByAddress(addr, STT_FUNC, result.symbol, result.symName);
+        if (result.haveSym && result.functionOffset == std::numeric_limits<Elf::Addr>::max())
+            result.functionOffset = addr - result.symbol.st_value;
+    }
+    finishUnit();
+}
@@ -0,0 +1,224 @@
+#!/usr/bin/python2
+# Add a DWARF 5 .debug_names section to an object with a single DWARF 4 unit,
+# as gcc doesn't write one. This made tests/names-debug_names.debug:
+#
+#   g++ -g -gdwarf-4 -O0 -shared -fPIC tests/names.cc -o names.so
+#   objcopy --only-keep-debug names.so names.debug
+#   tests/debug-names.py names.debug tests/names-debug_names.debug
+#
+# and tests/names-gdb_index.debug is the same, linked with
+# "-fuse-ld=gold -Wl,--gdb-index".
+#
+# The index is split into two name tables, to check we probe both. The names
+# in namespace "ns" are in a hash table, sized so that some bucket holds
+# several names, and "nosuchname" falls in an empty one. The rest are in a
+# table with no hash table at all. Entries have a DW_IDX_parent, except for
+# out-of-line definitions, so both ways of checking scopes are used.
+
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+
+DW_IDX_die_offset = 3
+DW_IDX_parent = 4
+DW_FORM_ref4 = 0x13
+DW_FORM_flag_present = 0x19
+
+TAGS = {
+    "DW_TAG_namespace": 0x39,
+    "DW_TAG_structure_type": 0x13,
+    "DW_TAG_class_type": 0x02,
+    "DW_TAG_union_type": 0x17,
+    "DW_TAG_subprogram": 0x2e,
+    "DW_TAG_variable": 0x34,
+}
+
+MISSING = "nosuchname"
+
+class Die(object):
+    def __init__(self, offset, depth, tag):
+        self.offset = offset
+        self.depth = depth
+        self.tag = tag
+        self.attrs = {}
+        self.parent = None
+
+def readDies(path):
+    dies = {}
+    stack = []
+    die = None
+    text = subprocess.check_output(["readelf", "--debug-dump=info", path])
+    for line in text.decode().splitlines():
+        m = re.match(r"\s*<(\d+)><([0-9a-f]+)>: Abbrev Number: \d+ \((\w+)\)", line)
+        if m:
+            die = Die(int(m.group(2), 16), int(m.group(1)), m.group(3))
+            del stack[die.depth:]
+            if stack:
+                die.parent = stack[-1]
+            stack.append(die)
+            dies[die.offset] = die
+            continue
+        m = re.match(r"\s*<[0-9a-f]+>\s+(DW_AT_\w+)\s*:\s*(.*)$", line)
+        if m and die:
+            value = m.group(2).strip()
+            if value.startswith("(indirect string"):
+                value = value.split("): ", 1)[1]
+            die.attrs[m.group(1)] = value
+    return dies
+
+def name(dies, die):
+    spec = die.attrs.get("DW_AT_specification")
+    if spec:
+        return name(dies, dies[int(spec.strip("<>"), 16)])
+    if "DW_AT_name" in die.attrs:
+        return die.attrs["DW_AT_name"]
+    if die.tag == "DW_TAG_namespace":
+        return "(anonymous namespace)"
+    return None
+
+def djb(s):
+    h = 5381
+    for c in s.lower().encode():
+        h = (h * 33 + (c if isinstance(c, int) else ord(c))) & 0xffffffff
+    return h
+
+def uleb(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7f
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return out
+
+def indexed(die):
+    return (die.tag in TAGS and "DW_AT_declaration" not in die.attrs
+          and die.depth != 0)
+
+def outermost(die):
+    while die.parent.depth != 0:
+        die = die.parent
+    return die
+
+def table(dies, entries, strings, bucketCount):
+    # Each entry is (die, name): group them by name, in bucket order.
+    names = {}
+    for die, entryName in entries:
+        names.setdefault(entryName, []).append(die)
+    if bucketCount:
+        order = sorted(names, key=lambda n: (djb(n) % bucketCount, n))
+    else:
+        order = sorted(names)
+
+    # Abbreviations, by tag and the form of DW_IDX_parent, if any.
+    abbrevCodes = {}
+    def abbrevFor(die):
+        if "DW_AT_specification" in die.attrs:
+            parentForm = None
+        elif die.parent.depth != 0 and indexed(die.parent):
+            parentForm = DW_FORM_ref4
+        else:
+            parentForm = DW_FORM_flag_present
+        key = (TAGS[die.tag], parentForm)
+        return abbrevCodes.setdefault(key, len(abbrevCodes) + 1), parentForm
+
+    # Lay out the entry pool first, so parents can be referred to.
+    entryOffset = {}
+    nameOffset = {}
+    pos = 0
+    for n in order:
+        nameOffset[n] = pos
+        for die in names[n]:
+            entryOffset[die.offset] = pos
+            code, parentForm = abbrevFor(die)
+            pos += len(uleb(code)) + 4 + (4 if parentForm == DW_FORM_ref4 else 0)
+        pos += 1
+    pool = bytearray()
+    for n in order:
+        for die in names[n]:
+            code, parentForm = abbrevFor(die)
+            pool += uleb(code) + struct.pack("<I", die.offset)
+            if parentForm == DW_FORM_ref4:
+                pool += struct.pack("<I", entryOffset[die.parent.offset])
+        pool.append(0)
+
+    abbrevs = bytearray()
+    for (tag, parentForm), code in sorted(abbrevCodes.items(), key=lambda a: a[1]):
+        abbrevs += uleb(code) + uleb(tag) + uleb(DW_IDX_die_offset) + uleb(DW_FORM_ref4)
+        if parentForm is not None:
+            abbrevs += uleb(DW_IDX_parent) + uleb(parentForm)
+        abbrevs += uleb(0) + uleb(0)
+    abbrevs += uleb(0)
+
+    body = struct.pack("<HHIIIIIII", 5, 0, 1, 0, 0, bucketCount, len(order), len(abbrevs), 0)
+    body += struct.pack("<I", 0) # the unit, at offset 0.
+    if bucketCount:
+        buckets = [0] * bucketCount
+        for i, n in enumerate(order):
+            bucket = djb(n) % bucketCount
+            if buckets[bucket] == 0:
+                buckets[bucket] = i + 1
+        body += struct.pack("<%dI" % bucketCount, *buckets)
+        body += struct.pack("<%dI" % len(order), *[djb(n) for n in order])
+    for n in order:
+        body += struct.pack("<I", strings.offset(n))
+    body += struct.pack("<%dI" % len(order), *[nameOffset[n] for n in order])
+    body = bytes(body) + bytes(abbrevs) + bytes(pool)
+    return struct.pack("<I", len(body)) + body
+
+def chooseBuckets(names):
+    for count in range(2, 4 * len(names)):
+        used = [djb(n) % count for n in names]
+        if len(set(used)) < len(used) and djb(MISSING) % count not in used:
+            return count
+    raise Exception("no bucket count works for %s" % names)
+
+class Strings(object):
+    """The contents of .debug_str, with the names we add."""
+    def __init__(self, data):
+        self.data = data
+        self.offsets = {}
+
+    def offset(self, s):
+        if s not in self.offsets:
+            self.offsets[s] = len(self.data)
+            self.data += s.encode() + b"\0"
+        return self.offsets[s]
+
+def main(src, dst):
+    dies = readDies(src)
+    entries = [(d, name(dies, d)) for d in sorted(dies.values(), key=lambda d: d.offset)
+          if indexed(d) and name(dies, d)]
+    nsEntries = [e for e in entries if outermost(e[0]).attrs.get("DW_AT_name") == "ns"
+          or ("DW_AT_specification" in e[0].attrs and inNamespace(dies, e[0], "ns"))]
+    rest = [e for e in entries if e not in nsEntries]
+
+    tmp = tempfile.mkdtemp()
+    strPath = os.path.join(tmp, "str")
+    namesPath = os.path.join(tmp, "names")
+    subprocess.check_call(["objcopy", "--dump-section", ".debug_str=" + strPath, src, os.devnull])
+    with open(strPath, "rb") as f:
+        strings = Strings(f.read())
+    nsTable = table(dies, nsEntries, strings, chooseBuckets(set(e[1] for e in nsEntries)))
+    restTable = table(dies, rest, strings, 0)
+    with open(strPath, "wb") as f:
+        f.write(strings.data)
+    with open(namesPath, "wb") as f:
+        f.write(nsTable + restTable)
+    subprocess.check_call(["objcopy", "--update-section", ".debug_str=" + strPath,
+          "--add-section", ".debug_names=" + namesPath, src, dst])
+    for path in (strPath, namesPath):
+        os.unlink(path)
+    os.rmdir(tmp)
+
+def inNamespace(dies, die, ns):
+    spec = dies[int(die.attrs["DW_AT_specification"].strip("<>"), 16)]
+    return outermost(spec).attrs.get("DW_AT_name") == ns
+
+if __name__ == "__main__":
+    main(sys.argv[1], sys.argv[2])
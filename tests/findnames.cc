@@ -0,0 +1,25 @@
+/*
+ * Look up names in an object's DWARF with Info::findDefinitions, for
+ * names-test.py. Prints each name, and the tags of the DIEs found for it.
+ */
+#include "libpstack/dwarf.h"
+
+#include <iostream>
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::clog << "usage: " << argv[0] << " <elf object> [name]...\n";
+        return 1;
+    }
+    Dwarf::ImageCache cache;
+    auto dwarf = cache.getDwarf(argv[1]);
+    for (int i = 2; i < argc; ++i) {
+        std::cout << argv[i] << ":";
+        for (const auto &die : dwarf->findDefinitions(argv[i]))
+            std::cout << " " << die.tag();
+        std::cout << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#!/usr/bin/python2
+# This tests that -U prints the 10 threads parked in "entry" as one stack,
+# and the main thread as another, in text and JSON, and can't be used with -a
+
+import pstack
+import json
+import subprocess
+
+core = pstack.CORE(["tests/thread"])
+
+# Find the LWPs of the threads in "entry" from the ungrouped text output.
+entryLwps = set()
+allLwps = set()
+for line in pstack.RUN([core]).splitlines():
+    if line.startswith("thread:"):
+        lwp = int(line.split(", ")[1].split(": ")[1])
+        allLwps.add(lwp)
+    elif line.startswith("#") and " in entry(" in line:
+        entryLwps.add(lwp)
+assert len(entryLwps) == 10
+mainLwps = allLwps - entryLwps
+assert len(mainLwps) == 1
+
+# The most common stack comes first.
+groups = json.loads(pstack.RUN(["-U", "-j", core]))
+assert [group["count"] for group in groups] == [10, 1]
+assert set(groups[0]["lwps"]) == entryLwps
+assert set(groups[1]["lwps"]) == mainLwps
+assert any(frame["die"] == "entry" for frame in groups[0]["ti_stack"])
+
+# Each text group starts "threads: <count>, lwps: <lwp>, <lwp>..."
+textGroups = []
+for line in pstack.RUN(["-U", core]).splitlines():
+    if line.startswith("threads:"):
+        count, lwps = line.split(", lwps: ")
+        textGroups.append((int(count.split(": ")[1]), set(int(lwp) for lwp in lwps.split(", "))))
+assert textGroups == [(10, entryLwps), (1, mainLwps)]
+
+# Grouped threads can have different arguments.
+args = subprocess.Popen(["./pstack", "-U", "-a", core], stderr=subprocess.PIPE)
+assert "-a can't be used with -U" in args.communicate()[1]
+assert args.returncode != 0
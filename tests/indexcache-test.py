@@ -0,0 +1,28 @@
+#!/usr/bin/python2
+# This tests that indexes saved with -c, and reused from there by a later
+# run, give the same stacks as a run that builds them from scratch
+
+import pstack
+import os
+import shutil
+import tempfile
+
+# The index files saved under "cache", one directory per build-id, with their
+# inode numbers: a rewritten index is renamed into place, so gets a new one.
+def indexes(cache):
+    return sorted((os.path.join(path, name), os.stat(os.path.join(path, name)).st_ino)
+            for path, _, names in os.walk(cache) for name in names)
+
+core = pstack.CORE(["tests/thread"])
+plain = pstack.RUN([core])
+
+cache = tempfile.mkdtemp()
+try:
+    assert pstack.RUN(["-c", cache, core]) == plain
+    saved = indexes(cache)
+    assert saved
+    assert pstack.RUN(["-c", cache, core]) == plain
+    # The second run reused the indexes rather than writing more.
+    assert indexes(cache) == saved
+finally:
+    shutil.rmtree(cache)
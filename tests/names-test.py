@@ -0,0 +1,53 @@
+#!/usr/bin/python2
+# This tests finding DIEs by name through .debug_names and .gdb_index, with
+# the objects built from names.cc by debug-names.py
+
+import os
+import subprocess
+
+VARIABLE = 0x34
+SUBPROGRAM = 0x2e
+STRUCT = 0x13
+NAMESPACE = 0x39
+
+def find(fixture, names):
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), fixture)
+    text = subprocess.check_output(["./findnames", path] + names)
+    found = {}
+    for line in text.splitlines():
+        name, tags = line.rsplit(":", 1)
+        found[name] = [int(tag) for tag in tags.split()]
+    return found
+
+expected = {
+    "topLevel": [VARIABLE],
+    "ns::inner": [VARIABLE],
+    "ns::S": [STRUCT],
+    "ns::S::method": [SUBPROGRAM],
+    "ns::nested": [NAMESPACE],
+    "ns::nested::deep": [VARIABLE],
+    "ns::useHidden": [SUBPROGRAM],
+    "Global": [STRUCT],
+    "global": [VARIABLE],
+    "useLocal": [SUBPROGRAM],
+    # Not in scope where asked for, or not there at all.
+    "S": [],
+    "nested::deep": [],
+    "local": [],
+    "nosuchname": [],
+    "ns::nosuchname": [],
+}
+
+# gold's .gdb_index names anonymous namespaces, and leaves out the
+# definitions of static members, so these are only in .debug_names.
+debugNamesOnly = {
+    "ns::hidden": [VARIABLE],
+    "ns::S::member": [VARIABLE],
+}
+
+for fixture, queries in [
+        ("names-gdb_index.debug", expected),
+        ("names-debug_names.debug", dict(expected, **debugNamesOnly)) ]:
+    found = find(fixture, list(queries))
+    for name, tags in queries.items():
+        assert found[name] == tags, "%s: %s: found %s, not %s" % (fixture, name, found[name], tags)
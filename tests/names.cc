@@ -0,0 +1,32 @@
+// Source of the names-*.debug fixtures for names-test.py. See debug-names.py
+// for how they're built: changes here need them rebuilt.
+int topLevel = 1;
+
+namespace ns {
+int inner = 2;
+struct S {
+    static int member;
+    int method();
+};
+int S::member = 3;
+int S::method() { return member; }
+namespace {
+int hidden = 4;
+}
+int useHidden() { return hidden; }
+namespace nested {
+int deep = 5;
+}
+}
+
+struct Global {
+    int field;
+};
+Global global;
+
+int
+useLocal()
+{
+    static int local = 6;
+    return local + ns::nested::deep;
+}
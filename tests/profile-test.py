@@ -0,0 +1,21 @@
+#!/usr/bin/python2
+# This tests that profiling a process stops when it exits, well before the
+# time limit, and prints the stacks sampled until then as folded stacks
+
+import pstack
+import subprocess
+import time
+
+child = subprocess.Popen(["sleep", "2"])
+start = time.time()
+folded = pstack.RUN(["-P", "20", "-T", "60", str(child.pid)])
+assert time.time() - start < 30
+child.wait()
+
+lines = folded.splitlines()
+assert lines
+for line in lines:
+    stack, count = line.rsplit(" ", 1)
+    assert stack and int(count) > 0
+# "sleep" spends its life in nanosleep.
+assert any("nanosleep" in line for line in lines)
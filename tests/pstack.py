@@ -17,3 +17,10 @@ def TEXT(cmd):
     cm = coremonitor.CoreMonitor( cmd, None )
     text = subprocess.check_output(["./pstack", "-a", cm.core()])
     return text
+
+def CORE(cmd):
+    cm = coremonitor.CoreMonitor( cmd, None )
+    return cm.core()
+
+def RUN(args):
+    return subprocess.check_output(["./pstack"] + args)
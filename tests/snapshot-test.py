@@ -0,0 +1,54 @@
+#!/usr/bin/python2
+# This tests that unwinding with parallel jobs, unwinding from a copy of the
+# stacks, and decoding a binary snapshot all find the same stacks as a plain
+# serial unwind
+
+import pstack
+import os
+import subprocess
+import tempfile
+
+# The thread and frame lines of a text dump. A decoded snapshot describes
+# the process and threads differently, so only keep the lwp of each thread.
+def stacks(text):
+    lines = []
+    for line in text.splitlines():
+        if line.startswith("thread:"):
+            lines.append(line.split(",")[1])
+        elif line.startswith("#"):
+            lines.append(line)
+    return lines
+
+core = pstack.CORE(["tests/thread"])
+serial = pstack.RUN([core])
+# we have 10 threads + main
+assert len([l for l in stacks(serial) if "lwp" in l]) == 11
+
+assert pstack.RUN(["-J", "4", core]) == serial
+assert pstack.RUN(["-S", "64", core]) == serial
+
+fd, snapshot = tempfile.mkstemp()
+os.close(fd)
+try:
+    assert pstack.RUN(["-o", snapshot, core]) == ""
+    assert stacks(pstack.RUN(["--decode", snapshot])) == stacks(serial)
+finally:
+    os.unlink(snapshot)
+
+# Check decoding "data" fails with "error".
+def decodeFails(data, error):
+    fd, snapshot = tempfile.mkstemp()
+    os.write(fd, data)
+    os.close(fd)
+    try:
+        decode = subprocess.Popen(["./pstack", "--decode", snapshot], stderr=subprocess.PIPE)
+        assert error in decode.communicate()[1]
+        assert decode.returncode != 0
+    finally:
+        os.unlink(snapshot)
+
+# A record claiming more data than the file holds must be rejected, without
+# trying to allocate what it claims.
+decodeFails("pstksnp1" + "\x01" + "\xff" * 9 + "\x01" + "abc", "truncated snapshot record")
+# A length longer than any 64-bit value needs is corrupt.
+decodeFails("pstksnp1" + "\x01" + "\xff" * 30 + "\x01", "corrupt snapshot record")